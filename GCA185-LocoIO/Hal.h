@@ -0,0 +1,75 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Hardware abstraction of LocoIno, so the same code runs on the board and
+ on a Linux host. The backend is HalAvr.h when built by the Arduino IDE
+ or tools/avr_build.sh (ARDUINO defined) and host/HalHost.h otherwise.
+
+ Every backend provides what the sketch takes from the Arduino core and
+ the libraries: millis(), micros(), random(), randomSeed(), the bit*()
+ macros, boolean, PROGMEM/pgm_read_byte(), _crc16_update(), E2END, the
+ LocoNet types (lnMsg, LN_STATUS, OPC_*, getLnMsgSize()) and the priority
+ delays LN_BACKOFF_MIN/INITIAL/MAX of the library. FW_STATE goes in
+ front of every global of the sketch: the host puts them all in one section
+ so a simulation can swap in the state of one board after another
+ (host/LocoInoSim.cpp). And the hal* functions:
+
+ Interrupts
+   halLock()                  disable interrupts, returns the state to restore
+   halUnlock(state)           restore it
+ I/O pins, 16 bit masks with I/O 1 in bit 0
+   halReadInputs()            level of the 16 pins
+   halWriteOutputs(on, off)   set the pins in on, clear the ones in off
+   halConfigurePins(pins, outputs)
+                              pins in outputs as outputs (off), the other
+                              ones as inputs with pull-up
+   halEdgeCapture(inputs)     call captureEdge() when one of these changes
+ EEPROM
+   halEeRead(addr, buf, len), halEeReadByte(addr), halEeUpdate(addr, value)
+   halEeReady(on)             call eeReady() every time the EEPROM is ready
+   halEeWrite(addr, value)    start writing a byte, from eeReady() only
+ LocoNet
+   halLnInit()
+   halLnReceive()             next packet received, NULL if none
+   halLnSend(msg, prioDelay)  one attempt to send msg (sendLocoNetPacketTry).
+                              LN_TX_PENDING if the backend does not wait for
+                              the end of the packet: msg is passed again,
+                              unchanged, until another status comes back
+   halLnSwitchSensor(msg)     decode a switch or sensor message into the
+                              notify*() callbacks
+ Serial port
+   halSerialBegin(baud), halSerialRoom(), halSerialWrite(byte)
+ *************************************************************************/
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#ifdef ARDUINO
+#include "HalAvr.h"
+#else
+#include "HalHost.h"
+#endif
+
+//halLnSend() status of an attempt still on the bus, never returned on the board
+#define LN_TX_PENDING ((LN_STATUS) 7)
+
+//Sketch functions called by the backend, from interrupts on the board
+void captureEdge();
+void eeReady();
+
+#endif /* HAL_H_ */
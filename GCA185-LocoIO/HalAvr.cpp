@@ -0,0 +1,44 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Interrupt vectors of the AVR backend (see HalAvr.h), forwarding to the
+ sketch.
+ *************************************************************************/
+
+#ifdef ARDUINO
+
+#include "Hal.h"
+
+//Pin change interrupts of the three ports with I/O pins
+ISR(PCINT0_vect) {
+	captureEdge();
+}
+
+ISR(PCINT1_vect) {
+	captureEdge();
+}
+
+ISR(PCINT2_vect) {
+	captureEdge();
+}
+
+ISR(EE_READY_vect) {
+	eeReady();
+}
+
+#endif
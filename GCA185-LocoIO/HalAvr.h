@@ -0,0 +1,148 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ ATmega328 backend of the HAL (see Hal.h), on the Arduino core, the MRRwA
+ LocoNet library and avr-libc. Everything is inline so the sketch costs
+ the same as with the registers written in place.
+
+ I/O 1-5 -> PD2-PD6, I/O 6-10 -> PB1-PB5, I/O 11-16 -> PC0-PC5.
+ PD0/PD1 are the serial port, PD7 is LocoNet TX (driven from an interrupt)
+ and PB0 is LocoNet RX: port writes keep them and are done with
+ interrupts disabled.
+ *************************************************************************/
+
+#ifndef HALAVR_H_
+#define HALAVR_H_
+
+#include <Arduino.h>
+#include <LocoNet.h>
+#include <utility/ln_sw_uart.h>   //sendLocoNetPacketTry() and the LN_BACKOFF_* delays
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+//One board, nothing to swap
+#define FW_STATE
+
+static inline uint8_t halLock() {
+	uint8_t oldSREG = SREG;
+
+	cli();
+	return (oldSREG);
+}
+static inline void halUnlock(uint8_t oldSREG) {
+	SREG = oldSREG;
+}
+
+//Level of the 16 I/O pins in a single pass over the port registers
+static inline uint16_t halReadInputs() {
+	uint8_t d, b, c;
+
+	d = PIND;
+	b = PINB;
+	c = PINC;
+	return (((d >> 2) & 0x1f) | ((uint16_t) ((b >> 1) & 0x1f) << 5) | ((uint16_t) (c & 0x3f) << 10));
+}
+static inline void halWriteOutputs(uint16_t on, uint16_t off) {
+	uint8_t oldSREG;
+
+	off &= ~on;
+	oldSREG = halLock();
+	PORTD = (PORTD | ((on & 0x1f) << 2)) & ~((off & 0x1f) << 2);
+	PORTB = (PORTB | (((on >> 5) & 0x1f) << 1)) & ~(((off >> 5) & 0x1f) << 1);
+	PORTC = (PORTC | ((on >> 10) & 0x3f)) & ~((off >> 10) & 0x3f);
+	halUnlock(oldSREG);
+}
+//One write of each register. PORT is written first so a new output does not show the pull-up.
+static inline void halConfigurePins(uint16_t pins, uint16_t outputs) {
+	uint8_t oldSREG, m, o;
+
+	oldSREG = halLock();
+	m = (pins & 0x1f) << 2;
+	o = (outputs & 0x1f) << 2;
+	PORTD = (PORTD & ~m) | (~o & m);
+	DDRD = (DDRD & ~m) | (o & m);
+	m = ((pins >> 5) & 0x1f) << 1;
+	o = ((outputs >> 5) & 0x1f) << 1;
+	PORTB = (PORTB & ~m) | (~o & m);
+	DDRB = (DDRB & ~m) | (o & m);
+	m = (pins >> 10) & 0x3f;
+	o = (outputs >> 10) & 0x3f;
+	PORTC = (PORTC & ~m) | (~o & m);
+	DDRC = (DDRC & ~m) | (o & m);
+	halUnlock(oldSREG);
+}
+//Pin change interrupts, same port bits as halReadInputs() (vectors in HalAvr.cpp)
+static inline void halEdgeCapture(uint16_t inputs) {
+	uint8_t oldSREG;
+
+	oldSREG = halLock();
+	PCMSK2 = (inputs & 0x1f) << 2;
+	PCMSK0 = ((inputs >> 5) & 0x1f) << 1;
+	PCMSK1 = (inputs >> 10) & 0x3f;
+	PCICR |= bit(PCIE0) | bit(PCIE1) | bit(PCIE2);
+	halUnlock(oldSREG);
+}
+
+static inline void halEeRead(uint16_t addr, void *buf, uint16_t len) {
+	eeprom_read_block(buf, (const void *) addr, len);
+}
+static inline uint8_t halEeReadByte(uint16_t addr) {
+	return (eeprom_read_byte((const uint8_t *) addr));
+}
+static inline void halEeUpdate(uint16_t addr, uint8_t value) {
+	eeprom_update_byte((uint8_t *) addr, value);
+}
+//EE_READY interrupt (vector in HalAvr.cpp)
+static inline void halEeReady(boolean on) {
+	if (on)
+		EECR |= bit(EERIE);
+	else
+		EECR &= ~bit(EERIE);
+}
+//No waiting: only called from the EE_READY interrupt, the EEPROM is free
+static inline void halEeWrite(uint16_t addr, uint8_t value) {
+	EEAR = addr;
+	EEDR = value;
+	EECR |= bit(EEMPE);
+	EECR |= bit(EEPE);
+}
+
+static inline void halLnInit() {
+	LocoNet.init(7);
+}
+static inline lnMsg *halLnReceive() {
+	return (LocoNet.receive());
+}
+static inline LN_STATUS halLnSend(lnMsg *msg, uint8_t prioDelay) {
+	return (sendLocoNetPacketTry(msg, prioDelay));
+}
+static inline void halLnSwitchSensor(lnMsg *msg) {
+	LocoNet.processSwitchSensorMessage(msg);
+}
+
+static inline void halSerialBegin(uint32_t baud) {
+	Serial.begin(baud);
+}
+static inline int halSerialRoom() {
+	return (Serial.availableForWrite());
+}
+static inline void halSerialWrite(uint8_t b) {
+	Serial.write(b);
+}
+
+#endif /* HALAVR_H_ */
@@ -24,10 +24,23 @@
  with 16 I/O that can be individually configured as Input (block sensors)
  or Outputs (switches, lights,...).
  Configuration is done through SV Loconet protocol and can be configured
- from Rocrail (Programming->GCA->GCA50).
+ from Rocrail (Programming->GCA->GCA50), with the SV1 format or with SV2
+ (4 SVs per packet, module address SV1 + 256 * SV2). A written SV takes effect
+ at once on its pin, without a reset.
+ Besides the GCA50 SVs, SV 51-66 hold the pulse length of outputs 1 to 16
+ in steps of 10 ms (0 keeps the default of 150 ms). SV 67-82 hold the
+ debounce time of inputs 1 to 16 in steps of 4 ms, up to 15 steps (0 reports
+ every edge, 255 keeps the default of 3 steps). SV 83-98 hold the release
+ delay of inputs 1 to 16 in steps of 100 ms: a free input is only reported
+ once it stays free that long (0 or 255 report it at once). SV 99-100 hold the
+ SV2 serial number of the module (low byte first), to be set once for every
+ module: SV2 CHANGE_ADDR is refused while it is 65535. Diagnostic counters
+ can be read (not written) as SVs from SV 128 on, see DIAG and readSVs().
+ Hardware is only reached through Hal.h, so the sketch also builds and
+ runs on a Linux host (CMakeLists.txt, host/).
  ------------------------------------------------------------------------
  PIN ASSIGNMENT:
- 0,1 -> Serial, used to debug and Loconet Monitor (uncomment DEBUG)
+ 0,1 -> Serial, binary trace of the module (TRACE_LEVEL in Trace.h)
  2,3,4,5,6 -> Configurable I/O from 1 to 5
  7 -> Loconet TX (connected to GCA185 shield)
  8 -> Loconet RX (connected to GCA185 shield)
@@ -42,19 +55,79 @@
  * Thanks also to Rocrail group - http://www.rocrail.org
  *************************************************************************/
 
-#include <Arduino.h>
-#include <LocoNet.h>
-#include <EEPROM.h>
+#include "Hal.h"
+#include "Trace.h"
 
+void processPacket();
 boolean processPeerPacket();
+boolean peerForMe();
 void sendPeerPacket(uint8_t p0, uint8_t p1, uint8_t p2);
+boolean processSv2Packet();
+void sendSv2Packet(uint8_t cmd, uint16_t dst, uint16_t adr, uint8_t *d);
+void programSV(uint8_t n, uint8_t value);
+uint16_t replyDelay();
+void decodeConfig();
+void decodePin(uint8_t n);
+uint8_t svPin(uint8_t n);
+void reconfigurePin(uint8_t n);
+void setEdgeCapture();
+void processInputs(uint16_t inputs);
+void debounceInputs();
+void reportInputs(uint16_t changed);
+void sendInputs(uint16_t inputs);
+void inputReport(uint8_t n, uint8_t level, lnMsg *msg);
+uint8_t readSV(uint8_t n);
+void readSVs(uint16_t n, uint8_t *buf, uint8_t count);
+uint8_t *putDiagWord(uint8_t *p, uint16_t value);
+void writeSV(uint8_t n, uint8_t value);
+boolean loadConfig();
+void eeService();
+void buildSwitchIndex();
+void switchIndexAdd(uint8_t n);
+void switchIndexRemove(uint8_t n);
+uint16_t switchPins(uint16_t addr);
+uint16_t pulseLength(uint8_t n);
+void timerArm(uint8_t slot, uint16_t ms);
+void timerCancel(uint32_t slots);
+uint32_t timerExpired();
+boolean txQueue(lnMsg *msg, uint16_t delay);
+void txService();
 
-//Uncomment this line to debug through the serial monitor
-#define DEBUG
 #define VERSION 101
 
-//Arduino pin assignment to each of the 16 outputs
-uint8_t pinMap[16] = { 2, 3, 4, 5, 6, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 };
+//Length of the pulse given to outputs configured as pulse when its SV is not set
+#define PULSE_MS 150
+//Unit of the per output pulse length SVs
+#define PULSE_UNIT_MS 10
+//Inputs are debounced every DEBOUNCE_MS, for the number of steps set in their SV
+#define DEBOUNCE_MS 4
+#define DEBOUNCE_STEPS 3
+//Unit of the per input release delay SVs
+#define RELEASE_UNIT_MS 100
+//Most LocoNet packets, and time, handled in every loop() before checking the inputs again
+#define RX_BUDGET 8
+#define RX_BUDGET_US 2000
+//Packets waiting to be sent and attempts before dropping one
+#define TXQ_SIZE 8
+#define TX_TRIES 25
+//Answers to broadcast SV requests wait for the slot of the module (REPLY_SLOTS of REPLY_SLOT_MS,
+//about the time of a 16 byte packet) so a scan of many modules does not end in collisions
+#define REPLY_SLOT_MS 10
+#define REPLY_SLOTS 64
+//SV writes are committed to EEPROM once there were none for EE_QUIET_MS
+#define EE_QUIET_MS 500
+
+//EEPROM journal: every commit writes the whole SV table as a new record in the next slot,
+//round robin from address 0, and then its sequence in the index at the end of the EEPROM.
+//Boot loads the record with the newest sequence in the index whose CRC is right, so a
+//commit cut by a power loss leaves the previous record in place.
+//Record: sequence, SV table, CRC16 of both (low byte first)
+#define JR_REC (SV_SIZE + 3)
+#define JR_SLOTS ((E2END + 1 - 2) / (JR_REC + 1))
+#define JR_INDEX (E2END + 1 - 2 - JR_SLOTS)   //Sequence of every slot, 0xff empty
+#define JR_MAGIC (E2END + 1 - 2)              //'L', 'J' once the journal is set up
+//1 = an input back to its level on the bus before its report went out still sends both changes
+#define TX_KEEP_BLIPS 1
 
 //3 bytes defining a pin behavior ( http://wiki.rocrail.net/doku.php?id=loconet-io-en )
 typedef struct {
@@ -69,206 +142,406 @@ typedef struct {
 	uint8_t addr_low;
 	uint8_t addr_high;
 	PIN_CFG pincfg[16];
+	uint8_t pulse[16];     //SV 51-66: pulse length of each output in PULSE_UNIT_MS, 0 or 255 = PULSE_MS
+	uint8_t debounce[16];  //SV 67-82: debounce steps of each input (1-15), 0 = none, 255 = DEBOUNCE_STEPS
+	uint8_t release[16];   //SV 83-98: release delay of each input in RELEASE_UNIT_MS, 0 or 255 = none
+	uint8_t serial_low;    //SV 99-100: SV2 serial number, SV2_NO_SERIAL = not set
+	uint8_t serial_high;
 } SV_TABLE;
 
+#define SV_SIZE sizeof(SV_TABLE)
+
 //Union to access the data with the struct or by index
 typedef union {
 	SV_TABLE svt;
-	uint8_t data[51];
+	uint8_t data[SV_SIZE];
 } SV_DATA;
 
-SV_DATA svtable;
-lnMsg *LnPacket;
+FW_STATE SV_DATA svtable;
+FW_STATE lnMsg *LnPacket;
+
+//Runtime view of the pin config, decoded from svtable when it is loaded or written
+typedef struct {
+	uint16_t output;     //cnfg bit 7: pin is an output
+	uint16_t pulse;      //cnfg bit 3: output gives a pulse
+	uint16_t hwreset;    //cnfg bit 2: continuous output with hardware reset
+	uint16_t dir;        //value2 bit 5: direction of outputs, switch/aux of inputs
+	uint16_t raw;        //Last level read on the pins, as returned by halReadInputs()
+	uint16_t state;      //Level of the inputs once debounced
+	uint16_t sent;       //Level of the inputs last reported
+	uint16_t release;    //Inputs with a release delay
+	uint16_t debounce;   //Inputs with a debounce time
+	uint16_t dbTime[4];  //Debounce steps of every input, one bit of the count per word
+	uint8_t rep[16][2];  //OPC_INPUT_REP in1/in2 of every input, level bit clear
+} PIN_RUN;
+
+FW_STATE PIN_RUN pinrun;
+
+//Vertical debounce counters, bit n of every word is the count of input n
+FW_STATE uint16_t dbCount[4];
+FW_STATE uint16_t dbLast;     //millis() of the last debounce step
+
+//What to do with every opcode received, so foreign traffic costs a single lookup
+#define LNC_SKIP 0    //Not for this module
+#define LNC_SWREQ 1   //Switch request, for the outputs
+#define LNC_INFO 2    //Sensor and switch reports, only traced
+#define LNC_PEER 3    //SV programming
+
+const uint8_t lnClass[256] PROGMEM = {
+	//0x00-0x7f are not opcodes
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	//0x80-0x9f: 2 byte messages (power, idle, ...)
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	//0xa0-0xbf: 4 byte messages, OPC_SW_REQ (b0), OPC_SW_REP (b1), OPC_INPUT_REP (b2), OPC_SW_STATE (bc)
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	LNC_SWREQ, LNC_INFO, LNC_INFO, 0, 0, 0, 0, 0, 0, 0, 0, 0, LNC_INFO, 0, 0, 0,
+	//0xc0-0xdf: 6 byte messages
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	//0xe0-0xff: variable length messages, OPC_PEER_XFER (e5)
+	0, 0, 0, 0, 0, LNC_PEER, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+//Diagnostic counters, read only SVs from SV_DIAG on. Laid out by readSVs() in the order of
+//DIAG without padding, 16 bit counters low byte first
+#define SV_DIAG 128
+#define SV_DIAG_SIZE 18
+
+//LocoNet SV programming v2 (SV2): the same OPC_PEER_XFER, with a command, a 16 bit module
+//and SV address and 4 data bytes. Module address = SV1 + 256 * SV2.
+//Byte positions in the packet
+#define SV2_CMD 3
+#define SV2_TYPE 4    //0x02 for SV2
+#define SV2_SVX1 5    //0x10 + high bits of the next 4 bytes
+#define SV2_DST 6     //Module address, low byte first
+#define SV2_ADR 8     //SV address, low byte first
+#define SV2_SVX2 10   //0x10 + high bits of the next 4 bytes
+#define SV2_D 11      //D1-D4
+//Commands, the reply has bit 6 set
+#define SV2_WRITE 0x01
+#define SV2_READ 0x02
+#define SV2_MASKED_WRITE 0x03
+#define SV2_WRITE4 0x05
+#define SV2_READ4 0x06
+#define SV2_DISCOVER 0x07
+#define SV2_IDENTIFY 0x08
+#define SV2_CHANGE_ADDR 0x09
+#define SV2_REPLY 0x40
+//Identity sent to DISCOVER and IDENTIFY, CHANGE_ADDR only applies to a matching one.
+//13 is the NMRA id for DIY. The serial is in the SV table, with the erased value every
+//module would match a CHANGE_ADDR
+#define SV2_MANUFACTURER 13
+#define SV2_DEVELOPER 0
+#define SV2_PRODUCT 185
+#define SV2_NO_SERIAL 0xffff
+
+typedef struct {
+	uint16_t edgeOverflow;  //Input edges lost because the edge ring was full
+	uint8_t edgeHighWater;  //Most edges waiting in the ring
+	uint8_t edgeLatency;    //Longest ms between capturing an edge and processing it
+	uint8_t rxBacklog;      //Most LocoNet packets found waiting in one loop()
+	uint16_t rxBudgetHits;  //loop() passes that ran out of RX budget with packets maybe left
+	uint8_t txDepth;        //Most packets waiting in the TX queue
+	uint16_t txDrops;       //Packets dropped, queue full or too many collisions (input reports start over)
+	uint16_t txRetries;     //Send attempts lost to a collision or error
+	uint16_t eeWrites;      //Bytes written to EEPROM
+	uint16_t eeSkips;       //Bytes not written, EEPROM already had the value
+	uint16_t eeCommits;     //SV table records committed to the journal
+} DIAG;
+
+FW_STATE volatile DIAG diag;
+
+//Input edges captured by the pin change interrupts, single producer (ISR) and consumer (loop)
+#define EDGE_RING 16   //Power of 2
+
+typedef struct {
+	uint16_t time;     //Low word of millis() when the edge was captured
+	uint16_t inputs;   //halReadInputs() after the edge
+} EDGE_EVT;
+
+FW_STATE volatile EDGE_EVT edgeRing[EDGE_RING];
+FW_STATE volatile uint8_t edgeHead;    //Only written by the ISR
+FW_STATE volatile uint8_t edgeTail;    //Only written by loop()
+FW_STATE uint16_t edgeLast;            //Inputs at the last captured edge, ISR only (or interrupts off)
+
+//SV programming replies waiting to be sent, in order of arrival once due. Input reports are
+//not queued, every input has its own slot (see txService)
+typedef struct {
+	lnMsg msg;
+	boolean used;
+	uint8_t seq;    //Order of arrival
+	uint16_t due;   //millis() from which it may be sent
+} TXQ_ENTRY;
+
+FW_STATE TXQ_ENTRY txq[TXQ_SIZE];
+FW_STATE uint8_t txSeq;         //Sequence of the next packet queued
+FW_STATE uint8_t txCur = 0xff;  //Entry being sent, TXQ_INPUT for an input report, 0xff none
+FW_STATE uint8_t txInput;       //Input whose report is being sent, or last sent
+FW_STATE uint8_t txLevel;       //Level in the input report being sent
+FW_STATE lnMsg txInputMsg;      //Input report being sent
+FW_STATE uint16_t txBus;        //Level of every input last sent on the bus
+FW_STATE uint16_t txBlip;       //Inputs back to the txBus level before being sent, the other level goes first
+
+#define TXQ_INPUT 0xfe
+FW_STATE uint8_t txPrio;        //Priority delay of the next attempt
+FW_STATE uint8_t txTries;       //Attempts of the entry being sent
+FW_STATE boolean txPending;     //Attempt started and not over (host simulation, see halLnSend())
+
+//Commit of svtable to the journal, written from the EE_READY interrupt
+FW_STATE volatile boolean eePending;   //svtable changed since the last commit
+FW_STATE volatile boolean eeBusy;      //EE_READY interrupt committing
+FW_STATE uint8_t eeNewest;             //Slot of the newest record
+FW_STATE uint8_t eeSeq = 0xfe;         //Sequence of the newest record
+FW_STATE uint8_t eeSlot;               //Slot being written
+FW_STATE uint8_t eePos;                //Next byte of the record, JR_REC for the index
+FW_STATE uint16_t eeCrc;               //CRC of the record so far
+FW_STATE uint16_t eeLastWrite;         //millis() of the last SV write
+
+//Switch addresses (value1) used by the outputs, rebuilt when the config changes
+typedef struct {
+	uint8_t addr;   //Switch address - 1
+	uint16_t pins;  //Outputs listening to this address
+} SW_IDX;
+
+FW_STATE uint8_t swUsed[32];   //One bit per address to reject foreign requests at once
+FW_STATE SW_IDX swIdx[16];
+FW_STATE uint8_t swCount;
+
+//Timer service: one deadline per slot, polled from loop() so nothing has to wait
+#define TMR_PULSE 0      //Slots 0-15: pulse off of output n
+#define TMR_RELEASE 16   //Slots 16-31: release delay of input n
+#define TMR_SLOTS 32
+
+FW_STATE uint16_t tmrDeadline[TMR_SLOTS];  //Low word of millis() when the slot expires
+FW_STATE uint32_t tmrArmed;                //Bit set for every pending slot
+FW_STATE uint16_t tmrNext;                 //Earliest pending deadline
+
+//Queue the input levels if an input changed, called from the pin change interrupts
+void captureEdge() {
+	uint16_t inputs;
+	uint8_t head, next, depth;
+
+	inputs = halReadInputs();
+	if (!((inputs ^ edgeLast) & ~pinrun.output))
+		return;
+
+	head = edgeHead;
+	next = (head + 1) & (EDGE_RING - 1);
+	if (next == edgeTail) {
+		//Ring full, the next edge queued carries the levels lost now
+		diag.edgeOverflow++;
+		return;
+	}
+	edgeRing[head].time = millis();
+	edgeRing[head].inputs = inputs;
+	edgeHead = next;
+	edgeLast = inputs;
+
+	depth = (next - edgeTail) & (EDGE_RING - 1);
+	if (depth > diag.edgeHighWater)
+		diag.edgeHighWater = depth;
+}
+//Delay of an answer to a broadcast: a slot by address so neighbours do not start together,
+//and a random part within it for modules sharing the slot
+uint16_t replyDelay() {
+	return ((svtable.svt.addr_low % REPLY_SLOTS) * REPLY_SLOT_MS + random(REPLY_SLOT_MS));
+}
 
 void setup() {
-	int n;
+	boolean valid;
+	uint8_t oldSREG;
 
 	// First initialize the LocoNet interface
-	LocoNet.init(7);
+	halLnInit();
 
-	// Configure the serial port for 57600 baud
-#ifdef DEBUG
-	Serial.begin(57600);
-	Serial.println("LocoNet Monitor");
-#endif
+	// Configure the serial port for the trace
+	traceInit();
 
-	//Load config from EEPROM
-	for (n = 0; n < 51; n++)
-		svtable.data[n] = EEPROM.read(n);
-
-	//Check for a valid config
-	if (svtable.svt.vrsion != VERSION) {
-		svtable.svt.vrsion = VERSION;
-		svtable.svt.addr_low = 81;
-		svtable.svt.addr_high = 1;
-		EEPROM.write(0, VERSION);
-		EEPROM.write(1, svtable.svt.addr_low);
-		EEPROM.write(2, svtable.svt.addr_high);
-	} else {
-		//Configure I/O
-		for (n = 0; n < 16; n++) {
-			if (bitRead(svtable.svt.pincfg[n].cnfg, 7))
-				pinMode(pinMap[n], OUTPUT);
-			else {
-				pinMode(pinMap[n], INPUT_PULLUP);
-				bitWrite(svtable.svt.pincfg[n].value2, 4, digitalRead(pinMap[n]));
-			}
-		}
+	//Load config from EEPROM and check it is valid. Without one every SV is 255 like
+	//an erased EEPROM (all pins outputs, defaults of the other SVs) at address 81/1
+	valid = loadConfig() && svtable.svt.vrsion == VERSION;
+	if (!valid) {
+		memset(svtable.data, 0xff, SV_SIZE);
+		writeSV(0, VERSION);
+		writeSV(1, 81);
+		writeSV(2, 1);
 	}
+	decodeConfig();
+
+	//Configure I/O, a single write of every port, and take the inputs as already reported
+	halConfigurePins(0xffff, pinrun.output);
+	oldSREG = halLock();
+	pinrun.raw = pinrun.state = pinrun.sent = txBus = edgeLast = halReadInputs();
+	halUnlock(oldSREG);
+	//Modules sharing a broadcast reply slot must not draw the same delays
+	randomSeed(micros() ^ svtable.svt.addr_low ^ ((uint32_t) svtable.svt.addr_high << 8) ^ ((uint32_t) svtable.svt.serial_low << 16)
+			^ ((uint32_t) svtable.svt.serial_high << 24));
+	TRACE(TR_BOOT, svtable.svt.vrsion, svtable.svt.addr_low, svtable.svt.addr_high, 0);
 }
 
 void loop() {
-	int n;
+	uint8_t tail, count;
+	uint16_t latency, start;
+	uint32_t expired;
 
-	// Check for any received LocoNet packets
-	LnPacket = LocoNet.receive();
-	if (LnPacket) {
-#ifdef DEBUG
-		// First print out the packet in HEX
-		Serial.print("RX: ");
-		uint8_t msgLen = getLnMsgSize(LnPacket);
-		for (uint8_t x = 0; x < msgLen; x++) {
-			uint8_t val = LnPacket->data[x];
-			// Print a leading 0 if less than 16 to make 2 HEX digits
-			if (val < 16)
-				Serial.print('0');
-			Serial.print(val, HEX);
-			Serial.print(' ');
-		}
-		Serial.println();
-#endif
+	// Check for any received LocoNet packets, a burst of them within the budget
+	start = micros();
+	for (count = 0; count < RX_BUDGET; ) {
+		LnPacket = halLnReceive();
+		if (!LnPacket)
+			break;
+		count++;
+		processPacket();
+		if ((uint16_t) ((uint16_t) micros() - start) >= RX_BUDGET_US)
+			break;
+	}
+	if (count > diag.rxBacklog)
+		diag.rxBacklog = count;
+	if (LnPacket)
+		diag.rxBudgetHits++;
 
-		// If this packet was not a Switch or Sensor Message checks por PEER packet
-		if (!LocoNet.processSwitchSensorMessage(LnPacket)) {
-			processPeerPacket();
-		}
+	//Nothing received, time to send the trace and commit SVs
+	if (!count) {
+		traceFlush();
+		eeService();
 	}
 
-	// Check inputs to inform
-	for (n = 0; n < 16; n++) {
-		if (!bitRead(svtable.svt.pincfg[n].cnfg, 7))   //Setup as an Input
-				{
-			//Check if state changed
-			if (digitalRead(pinMap[n]) != bitRead(svtable.svt.pincfg[n].value2, 4)) {
-#ifdef DEBUG
-				Serial.print("INPUT ");
-				Serial.print(n);
-				Serial.print(" IN PIN ");
-				Serial.print(pinMap[n]);
-				Serial.print(" CHANGED, INFORM ");
-				Serial.println(svtable.svt.pincfg[n].value1 << 1 | bitRead(svtable.svt.pincfg[n].value2, 5));
-#endif
+	//Finish the pulses and release delays whose time is over
+	expired = timerExpired();
+	if (expired) {
+		halWriteOutputs(0, (uint16_t) (expired >> TMR_PULSE));
+		sendInputs((uint16_t) (expired >> TMR_RELEASE));
+	}
 
-				LocoNet.send(OPC_INPUT_REP, svtable.svt.pincfg[n].value1, svtable.svt.pincfg[n].value2);
-				//Update state to detect flank (use bit in value2 of SV)
-				bitWrite(svtable.svt.pincfg[n].value2, 4, digitalRead(pinMap[n]));
+	//Input edges captured since the last pass, in the order they happened
+	tail = edgeTail;
+	while (tail != edgeHead) {
+		latency = (uint16_t) millis() - edgeRing[tail].time;
+		if (latency > diag.edgeLatency)
+			diag.edgeLatency = latency > 0xff ? 0xff : latency;
+		TRACE_EDGE(edgeRing[tail].inputs, edgeRing[tail].time);
+		processInputs(edgeRing[tail].inputs);
+		tail = (tail + 1) & (EDGE_RING - 1);
+		edgeTail = tail;
+	}
 
-			}
-		}
+	//Poll as well, for edges lost when the ring was full
+	processInputs(halReadInputs());
+
+	txService();
+
+	if ((uint16_t) ((uint16_t) millis() - dbLast) >= DEBOUNCE_MS) {
+		dbLast = millis();
+		debounceInputs();
 	}
+}
+
+//Handle the packet in LnPacket
+void processPacket() {
+	TRACE_PACKET(TR_RX, LnPacket->data, getLnMsgSize(LnPacket));
 
+	switch (pgm_read_byte(&lnClass[LnPacket->data[0]])) {
+	case LNC_SWREQ:
+		//Requests for addresses without outputs here are not decoded at all
+		if (switchPins((((LnPacket->data[2] & 0x0f) << 7) | LnPacket->data[1]) + 1))
+			halLnSwitchSensor(LnPacket);
+		break;
+#if TRACE_LEVEL >= 2
+	case LNC_INFO:
+		halLnSwitchSensor(LnPacket);
+		break;
+#endif
+	case LNC_PEER:
+		processPeerPacket();
+		break;
+	}
 }
 
 // This call-back function is called from LocoNet.processSwitchSensorMessage
 // for all Sensor messages
 void notifySensor(uint16_t Address, uint8_t State) {
-#ifdef DEBUG
-	Serial.print("Sensor: ");
-	Serial.print(Address, DEC);
-	Serial.print(" - ");
-	Serial.println(State ? "Active" : "Inactive");
-#endif
+	TRACE_BUS(TR_SENSOR, Address, Address >> 8, State ? 1 : 0, 0);
 }
 
 // This call-back function is called from LocoNet.processSwitchSensorMessage
 // for all Switch Request messages
 void notifySwitchRequest(uint16_t Address, uint8_t Output, uint8_t Direction) {
 	int n;
+	uint16_t pins, match, cont, pulses, on, off;
 
 	//Direction must be changed to 0 or 1, not 0 or 32
 	Direction ? Direction = 1 : Direction = 0;
 
-#ifdef DEBUG
-	Serial.print("Switch Request: ");
-	Serial.print(Address, DEC);
-	Serial.print(':');
-	Serial.print(Direction ? "Closed" : "Thrown");
-	Serial.print(" - ");
-	Serial.println(Output ? "On" : "Off");
-#endif
+	//Every output assigned to the Address follows the request
+	pins = switchPins(Address);
+	if (!pins)
+		return;
 
-	//Check if the Address is assigned, configured as output and same Direction
-	for (n = 0; n < 16; n++) {
-		if ((svtable.svt.pincfg[n].value1 == Address - 1) &&  //Address
-				(bitRead(svtable.svt.pincfg[n].cnfg,7) == 1))   //Setup as an Output
-				{
-
-			//If pulse (always hardware reset) and Direction, only listen ON message
-			if (bitRead(svtable.svt.pincfg[n].cnfg,3) == 1 && bitRead(svtable.svt.pincfg[n].value2,5) == Direction
-					&& Output) {
-				digitalWrite(pinMap[n], HIGH);
-				delay(150);
-				digitalWrite(pinMap[n], LOW);
-				break;
-			}
-			//If continue and hardware reset and Direction
-			else if (bitRead(svtable.svt.pincfg[n].cnfg,3) == 0 && bitRead(svtable.svt.pincfg[n].cnfg,2) == 1
-					&& bitRead(svtable.svt.pincfg[n].value2,5) == Direction) {
-				if (Output)
-					digitalWrite(pinMap[n], HIGH);
-				else
-					digitalWrite(pinMap[n], LOW);
-				break;
-			}
-			//If continue and software reset, one Direction ON turns on and other Direction ON turns off
-			//OFF messages are not listened
-			else if (bitRead(svtable.svt.pincfg[n].cnfg,3) == 0 && bitRead(svtable.svt.pincfg[n].cnfg,2) == 0
-					&& Output) {
-				if (!Direction)
-					digitalWrite(pinMap[n], HIGH);
-				else
-					digitalWrite(pinMap[n], LOW);
-				break;
-			}
-		}
-	}
+	TRACE(TR_SWREQ, Address, Address >> 8, Output ? 1 : 0, Direction);
+
+	//Outputs configured with the same Direction
+	match = pins & (Direction ? pinrun.dir : ~pinrun.dir);
+	on = off = 0;
+	pulses = 0;
+
+	//If continue and hardware reset and Direction, follow ON and OFF
+	cont = match & ~pinrun.pulse & pinrun.hwreset;
+	if (Output) {
+		on |= cont;
+
+		//If pulse (always hardware reset) and Direction, only listen ON message
+		pulses = match & pinrun.pulse;
+		on |= pulses;
+
+		//If continue and software reset, one Direction ON turns on and other Direction ON turns off
+		//OFF messages are not listened
+		cont = pins & ~pinrun.pulse & ~pinrun.hwreset;
+		if (!Direction)
+			on |= cont;
+		else
+			off |= cont;
+	} else
+		off |= cont;
+
+	halWriteOutputs(on, off);
+
+	//Pulse outputs go off later from loop(), several pulses can overlap
+	for (n = 0; pulses; n++, pulses >>= 1)
+		if (pulses & 1)
+			timerArm(TMR_PULSE + n, pulseLength(n));
 }
 
 // This call-back function is called from LocoNet.processSwitchSensorMessage
 // for all Switch Report messages
 void notifySwitchReport(uint16_t Address, uint8_t Output, uint8_t Direction) {
-#ifdef DEBUG
-	Serial.print("Switch Report: ");
-	Serial.print(Address, DEC);
-	Serial.print(':');
-	Serial.print(Direction ? "Closed" : "Thrown");
-	Serial.print(" - ");
-	Serial.println(Output ? "On" : "Off");
-#endif
+	TRACE_BUS(TR_SWREP, Address, Address >> 8, Output ? 1 : 0, Direction ? 1 : 0);
 }
 
 // This call-back function is called from LocoNet.processSwitchSensorMessage
 // for all Switch State messages
 void notifySwitchState(uint16_t Address, uint8_t Output, uint8_t Direction) {
-#ifdef DEBUG
-	Serial.print("Switch State: ");
-	Serial.print(Address, DEC);
-	Serial.print(':');
-	Serial.print(Direction ? "Closed" : "Thrown");
-	Serial.print(" - ");
-	Serial.println(Output ? "On" : "Off");
-#endif
+	TRACE_BUS(TR_SWSTATE, Address, Address >> 8, Output ? 1 : 0, Direction ? 1 : 0);
 }
 
 boolean processPeerPacket() {
-	//Check is a OPC_PEER_XFER message
+	uint8_t d[3];
+
+	//Check is a OPC_PEER_XFER message to me, before unpacking anything
 	if (LnPacket->px.command != OPC_PEER_XFER)
 		return (false);
-
-	//Check is my destination
-	if ((LnPacket->px.dst_l != 0 || LnPacket->px.d5 != 0)
-			&& (LnPacket->px.dst_l != 0x7f || LnPacket->px.d5 != svtable.svt.addr_high)
-			&& (LnPacket->px.dst_l != svtable.svt.addr_low || LnPacket->px.d5 != svtable.svt.addr_high))
+	if (LnPacket->data[SV2_TYPE] == 0x02 && (LnPacket->data[SV2_SVX1] & 0xf0) == 0x10
+			&& (LnPacket->data[SV2_SVX2] & 0xf0) == 0x10)
+		return (processSv2Packet());
+	if (!peerForMe())
 		return (false);
 
 	//Set high bits in right position
@@ -285,30 +558,16 @@ boolean processPeerPacket() {
 	//OPC_PEER_XFER D1 -> Command (1 SV write, 2 SV read)
 	//OPC_PEER_XFER D2 -> Register to read or write
 	if (LnPacket->px.d1 == 2) {
-		sendPeerPacket(svtable.data[LnPacket->px.d2], svtable.data[LnPacket->px.d2 + 1],
-				svtable.data[LnPacket->px.d2 + 2]);
+		readSVs(LnPacket->px.d2, d, 3);
+		sendPeerPacket(d[0], d[1], d[2]);
 		return (true);
 	}
 
 	//Write command
 	if (LnPacket->px.d1 == 1) {
 		//SV 0 contains the program version (write SV0 == RESET? )
-		if (LnPacket->px.d2 > 0) {
-			//Store data
-			svtable.data[LnPacket->px.d2] = LnPacket->px.d4;
-			EEPROM.write(LnPacket->px.d2, LnPacket->px.d4);
-
-#ifdef DEBUG
-			Serial.print("ESCRITURA ");
-			Serial.print(LnPacket->px.d2);
-			Serial.print(" <== ");
-			Serial.print(LnPacket->px.d4);
-			Serial.print(" | ");
-			Serial.print(LnPacket->px.d4, HEX);
-			Serial.print(" | ");
-			Serial.println(LnPacket->px.d4, BIN);
-#endif
-		}
+		if (LnPacket->px.d2 > 0 && LnPacket->px.d2 < SV_SIZE)
+			programSV(LnPacket->px.d2, LnPacket->px.d4);
 
 		//Answer packet
 		sendPeerPacket(0x00, 0x00, LnPacket->px.d4);
@@ -319,6 +578,96 @@ boolean processPeerPacket() {
 
 }
 
+//SV2 command in LnPacket
+boolean processSv2Packet() {
+	uint8_t n, cmd, d[4];
+	uint16_t dst, adr, me, serial;
+
+	//Destination first, only its two high bits come from SVX1: the rest is unpacked once it is for me
+	cmd = LnPacket->data[SV2_CMD];
+	dst = (LnPacket->data[SV2_DST] | ((LnPacket->data[SV2_SVX1] & 0x01) << 7))
+			| ((LnPacket->data[SV2_DST + 1] | ((LnPacket->data[SV2_SVX1] & 0x02) << 6)) << 8);
+	me = svtable.svt.addr_low | (svtable.svt.addr_high << 8);
+	if (dst != me && cmd != SV2_DISCOVER && cmd != SV2_CHANGE_ADDR)
+		return (false);
+
+	adr = (LnPacket->data[SV2_ADR] | ((LnPacket->data[SV2_SVX1] & 0x04) << 5))
+			| ((LnPacket->data[SV2_ADR + 1] | ((LnPacket->data[SV2_SVX1] & 0x08) << 4)) << 8);
+	for (n = 0; n < 4; n++)
+		bitWrite(LnPacket->data[SV2_D + n], 7, bitRead(LnPacket->data[SV2_SVX2], n));
+	memcpy(d, &LnPacket->data[SV2_D], sizeof(d));
+	serial = svtable.svt.serial_low | (svtable.svt.serial_high << 8);
+
+	//Addressed by identity, DST is the new address
+	if (cmd == SV2_CHANGE_ADDR) {
+		if (serial == SV2_NO_SERIAL || adr != (SV2_MANUFACTURER | (SV2_DEVELOPER << 8))
+				|| d[0] != (SV2_PRODUCT & 0xff) || d[1] != (SV2_PRODUCT >> 8)
+				|| d[2] != (serial & 0xff) || d[3] != (serial >> 8))
+			return (false);
+		programSV(offsetof(SV_TABLE, addr_low), dst & 0xff);
+		programSV(offsetof(SV_TABLE, addr_high), dst >> 8);
+		me = dst;
+	}
+
+	switch (cmd) {
+	case SV2_WRITE:
+	case SV2_MASKED_WRITE:
+		if (adr > 0 && adr < SV_SIZE) {
+			if (cmd == SV2_MASKED_WRITE)
+				d[0] = (readSV(adr) & ~d[1]) | (d[0] & d[1]);
+			programSV(adr, d[0]);
+		}
+		//Falls through - the reply holds the SV as it is now
+	case SV2_READ:
+		readSVs(adr, d, 1);
+		d[1] = d[2] = d[3] = 0;
+		break;
+	case SV2_WRITE4:
+		for (n = 0; n < 4; n++) {
+			if (adr + n > 0 && adr + n < SV_SIZE)
+				programSV(adr + n, d[n]);
+		}
+		//Falls through
+	case SV2_READ4:
+		readSVs(adr, d, 4);
+		break;
+	case SV2_DISCOVER:
+	case SV2_IDENTIFY:
+	case SV2_CHANGE_ADDR:
+		adr = SV2_MANUFACTURER | (SV2_DEVELOPER << 8);
+		d[0] = SV2_PRODUCT & 0xff;
+		d[1] = SV2_PRODUCT >> 8;
+		d[2] = serial & 0xff;
+		d[3] = serial >> 8;
+		break;
+	default:
+		return (false);
+	}
+
+	sendSv2Packet(cmd | SV2_REPLY, me, adr, d);
+	return (true);
+}
+
+//Store a written SV and apply it to its pin
+void programSV(uint8_t n, uint8_t value) {
+	uint8_t pin;
+
+	writeSV(n, value);
+	pin = svPin(n);
+	if (pin != 0xff)
+		reconfigurePin(pin);
+	TRACE(TR_SVWRITE, n, value, 0, 0);
+}
+
+//Check the OPC_PEER_XFER in LnPacket is for me (broadcast, my sub-address range or my address)
+boolean peerForMe() {
+	if (LnPacket->px.dst_l == 0 && LnPacket->px.d5 == 0)
+		return (true);
+	if (LnPacket->px.d5 != svtable.svt.addr_high)
+		return (false);
+	return (LnPacket->px.dst_l == 0x7f || LnPacket->px.dst_l == svtable.svt.addr_low);
+}
+
 void sendPeerPacket(uint8_t p0, uint8_t p1, uint8_t p2) {
 	lnMsg txPacket;
 
@@ -356,10 +705,635 @@ void sendPeerPacket(uint8_t p0, uint8_t p1, uint8_t p2) {
 	bitWrite(txPacket.px.pxct2, 3, bitRead(txPacket.px.d8,7));
 	bitClear(txPacket.px.d8, 7);
 
-	LocoNet.send(&txPacket);
+	//Every module answers a broadcast, spread the answers
+	txQueue(&txPacket, LnPacket->px.dst_l == 0 || LnPacket->px.dst_l == 0x7f ? replyDelay() : 0);
+}
+void sendSv2Packet(uint8_t cmd, uint16_t dst, uint16_t adr, uint8_t *d) {
+	lnMsg txPacket;
+	uint8_t n;
+
+	txPacket.data[0] = OPC_PEER_XFER;
+	txPacket.data[1] = 0x10;
+	txPacket.data[2] = svtable.svt.addr_low & 0x7f;
+	txPacket.data[SV2_CMD] = cmd;
+	txPacket.data[SV2_TYPE] = 0x02;
+	txPacket.data[SV2_DST] = dst;
+	txPacket.data[SV2_DST + 1] = dst >> 8;
+	txPacket.data[SV2_ADR] = adr;
+	txPacket.data[SV2_ADR + 1] = adr >> 8;
+	memcpy(&txPacket.data[SV2_D], d, 4);
+
+	//High bits in SVX1 and SVX2
+	txPacket.data[SV2_SVX1] = 0x10;
+	txPacket.data[SV2_SVX2] = 0x10;
+	for (n = 0; n < 4; n++) {
+		bitWrite(txPacket.data[SV2_SVX1], n, bitRead(txPacket.data[SV2_DST + n], 7));
+		bitClear(txPacket.data[SV2_DST + n], 7);
+		bitWrite(txPacket.data[SV2_SVX2], n, bitRead(txPacket.data[SV2_D + n], 7));
+		bitClear(txPacket.data[SV2_D + n], 7);
+	}
+
+	txQueue(&txPacket, cmd == (SV2_DISCOVER | SV2_REPLY) ? replyDelay() : 0);
+}
+
+
+//Decode the pin config of svtable into the runtime view used by loop() and the callbacks
+void decodeConfig() {
+	uint8_t n;
+
+	for (n = 0; n < 16; n++)
+		decodePin(n);
+	memset(dbCount, 0, sizeof(dbCount));
+	buildSwitchIndex();
+	setEdgeCapture();
+}
+void decodePin(uint8_t n) {
+	uint8_t b, steps;
+	PIN_CFG *cfg = &svtable.svt.pincfg[n];
+
+	bitWrite(pinrun.output, n, bitRead(cfg->cnfg, 7));
+	bitWrite(pinrun.pulse, n, bitRead(cfg->cnfg, 3));
+	bitWrite(pinrun.hwreset, n, bitRead(cfg->cnfg, 2));
+	bitWrite(pinrun.dir, n, bitRead(cfg->value2, 5));
+
+	//Level (bit 4) is added when the report is sent
+	pinrun.rep[n][0] = cfg->value1 & 0x7f;
+	pinrun.rep[n][1] = cfg->value2 & 0x6f;
+
+	bitWrite(pinrun.release, n,
+			svtable.svt.release[n] != 0 && svtable.svt.release[n] != 0xff && !bitRead(pinrun.output, n));
+
+	steps = svtable.svt.debounce[n];
+	if (steps == 0xff)
+		steps = DEBOUNCE_STEPS;
+	else if (steps > 15)
+		steps = 15;
+	if (bitRead(pinrun.output, n))
+		steps = 0;
+	bitWrite(pinrun.debounce, n, steps != 0);
+	for (b = 0; b < 4; b++)
+		bitWrite(pinrun.dbTime[b], n, bitRead(steps, b));
+}
+//Pin whose behavior depends on SV n, 0xff for the other SVs
+uint8_t svPin(uint8_t n) {
+	if (n >= offsetof(SV_TABLE, pincfg) && n < offsetof(SV_TABLE, pulse))
+		return ((n - offsetof(SV_TABLE, pincfg)) / sizeof(PIN_CFG));
+	if (n >= offsetof(SV_TABLE, debounce) && n < offsetof(SV_TABLE, release))
+		return (n - offsetof(SV_TABLE, debounce));
+	if (n >= offsetof(SV_TABLE, release) && n < offsetof(SV_TABLE, serial_low))
+		return (n - offsetof(SV_TABLE, release));
+	//Pulse lengths are read when the pulse starts
+	return (0xff);
+}
+//Apply a new config of pin n, leaving the other pins and their pending work alone
+void reconfigurePin(uint8_t n) {
+	uint16_t mask = bit(n);
+	uint16_t before = pinrun.output;
+	uint8_t oldSREG, b;
+
+	switchIndexRemove(n);
+	decodePin(n);
+	if (bitRead(pinrun.output, n))
+		switchIndexAdd(n);
+
+	if ((before ^ pinrun.output) & mask) {
+		//Direction changed: drop its pulse or release, set the port bit and the edge capture
+		timerCancel(((uint32_t) mask << TMR_PULSE) | ((uint32_t) mask << TMR_RELEASE));
+		halConfigurePins(mask, pinrun.output);
+		setEdgeCapture();
+	}
+
+	//Debounce starts over from the current level
+	for (b = 0; b < 4; b++)
+		dbCount[b] &= ~mask;
+	oldSREG = halLock();
+	b = bitRead(halReadInputs(), n);
+	bitWrite(edgeLast, n, b);
+	halUnlock(oldSREG);
+	bitWrite(pinrun.raw, n, b);
+
+	//Same direction: the reports still pending and the release delay go on as they were
+	if (!((before ^ pinrun.output) & mask))
+		return;
 
-#ifdef DEBUG
-	Serial.println("Packet sent!");
+	//New input: report its level. New output: nothing to report
+	bitWrite(pinrun.state, n, b);
+	bitWrite(pinrun.sent, n, !b);
+	bitWrite(txBus, n, !b);
+	bitClear(txBlip, n);
+	if (bitRead(pinrun.output, n)) {
+		bitWrite(pinrun.sent, n, b);
+		bitWrite(txBus, n, b);
+	} else
+		sendInputs(mask);
+}
+
+//Enable the pin change interrupt of the inputs only
+void setEdgeCapture() {
+	uint8_t oldSREG;
+
+	oldSREG = halLock();
+	halEdgeCapture(~pinrun.output);
+	edgeLast = halReadInputs();
+	halUnlock(oldSREG);
+}
+
+//Take a new reading of the pins, inputs without debounce are reported at once
+void processInputs(uint16_t inputs) {
+	pinrun.raw = inputs;
+	reportInputs((inputs ^ pinrun.state) & ~pinrun.output & ~pinrun.debounce);
+}
+
+//One debounce step for all the inputs at once, with vertical counters:
+//an input is reported when it differs from its debounced level for its number of steps
+void debounceInputs() {
+	uint16_t delta, carry, next, done;
+
+	//Counters restart on the inputs back to their debounced level
+	delta = (pinrun.raw ^ pinrun.state) & pinrun.debounce;
+	dbCount[0] &= delta;
+	dbCount[1] &= delta;
+	dbCount[2] &= delta;
+	dbCount[3] &= delta;
+
+	//Count one step on the others
+	carry = dbCount[0] & delta;
+	dbCount[0] ^= delta;
+	next = dbCount[1] & carry;
+	dbCount[1] ^= carry;
+	carry = dbCount[2] & next;
+	dbCount[2] ^= next;
+	dbCount[3] ^= carry;
+
+	//Inputs whose count reached their debounce steps
+	done = delta & ~((dbCount[0] ^ pinrun.dbTime[0]) | (dbCount[1] ^ pinrun.dbTime[1])
+			| (dbCount[2] ^ pinrun.dbTime[2]) | (dbCount[3] ^ pinrun.dbTime[3]));
+	if (done) {
+		dbCount[0] &= ~done;
+		dbCount[1] &= ~done;
+		dbCount[2] &= ~done;
+		dbCount[3] &= ~done;
+		reportInputs(done);
+	}
+}
+
+//Change the debounced state of the inputs in mask changed and report them
+void reportInputs(uint16_t changed) {
+	uint8_t n;
+	uint16_t delayed, direct;
+
+	if (!changed)
+		return;
+
+	//Update state to detect flank
+	pinrun.state ^= changed;
+
+	//Inputs going free (high) with a release delay wait for it, occupied ones go out at once
+	delayed = changed & pinrun.state & pinrun.release;
+	direct = changed & ~delayed;
+	timerCancel((uint32_t) direct << TMR_RELEASE);
+	for (n = 0; delayed; n++, delayed >>= 1)
+		if (delayed & 1)
+			timerArm(TMR_RELEASE + n, svtable.svt.release[n] * RELEASE_UNIT_MS);
+
+	sendInputs(direct);
+}
+
+//Report the inputs in mask inputs whose state differs from the one last reported
+void sendInputs(uint16_t inputs) {
+#if TRACE_LEVEL >= 1
+	uint8_t n;
 #endif
+
+	inputs &= pinrun.state ^ pinrun.sent;
+	pinrun.sent ^= inputs;
+
+	//txService() sends every input whose level differs from the bus, so a report still
+	//waiting is superseded by the new level
+#if TX_KEEP_BLIPS
+	txBlip |= inputs & ~(pinrun.sent ^ txBus);
+#endif
+
+#if TRACE_LEVEL >= 1
+	for (n = 0; inputs; n++, inputs >>= 1)
+		if (inputs & 1)
+			TRACE(TR_INPUT, n, bitRead(pinrun.sent, n) ? 0 : 1, pinrun.rep[n][0], pinrun.rep[n][1]);
+#endif
+}
+
+//Build the OPC_INPUT_REP of input n with pin level level
+void inputReport(uint8_t n, uint8_t level, lnMsg *msg) {
+	//Inputs have pull-up and are active low, the level sent is the inverse of the pin
+	msg->data[0] = OPC_INPUT_REP;
+	msg->data[1] = pinrun.rep[n][0];
+	msg->data[2] = pinrun.rep[n][1] | (level ? 0 : 0x10);
+	msg->data[3] = 0xff ^ msg->data[0] ^ msg->data[1] ^ msg->data[2];
 }
 
+//Queue a packet to be sent by txService() delay ms from now, it is dropped if the queue is full
+boolean txQueue(lnMsg *msg, uint16_t delay) {
+	uint8_t n, free, depth, len, sum;
+
+	free = 0xff;
+	depth = 0;
+	for (n = 0; n < TXQ_SIZE; n++) {
+		if (!txq[n].used)
+			free = n;
+		else
+			depth++;
+	}
+
+	if (free == 0xff) {
+		diag.txDrops++;
+		return (false);
+	}
+	if (++depth > diag.txDepth)
+		diag.txDepth = depth;
+
+	//Checksum here, the packet is sent as it is
+	len = getLnMsgSize(msg);
+	for (n = 0, sum = 0xff; n < len - 1; n++)
+		sum ^= msg->data[n];
+	msg->data[len - 1] = sum;
+
+	memcpy(&txq[free].msg, msg, len);
+	txq[free].used = true;
+	txq[free].seq = txSeq++;
+	txq[free].due = (uint16_t) millis() + delay;
+	return (true);
+}
+
+//Send state machine, one attempt per call so backoff never waits inside loop().
+//Input reports go first, one per input with its latest level, then the queue
+void txService() {
+	uint8_t n;
+	uint16_t pending, now;
+	lnMsg *msg;
+	LN_STATUS status;
+
+	pending = ((pinrun.sent ^ txBus) | txBlip) & ~pinrun.output;
+
+	//Next packet: an input report, round robin, else the oldest of the due ones
+	if (txCur == 0xff) {
+		if (pending) {
+			n = txInput;
+			do
+				n = (n + 1) & 15;
+			while (!bitRead(pending, n));
+			txInput = n;
+			txCur = TXQ_INPUT;
+		} else {
+			now = millis();
+			for (n = 0; n < TXQ_SIZE; n++) {
+				if (!txq[n].used || (int16_t) (txq[n].due - now) > 0)
+					continue;
+				if (txCur == 0xff || (int8_t) (txq[n].seq - txq[txCur].seq) < 0)
+					txCur = n;
+			}
+			if (txCur == 0xff)
+				return;
+		}
+		txPrio = LN_BACKOFF_INITIAL;
+		txTries = 0;
+	}
+
+	if (txPending) {
+		//The attempt on the bus goes on with the same packet
+		msg = txCur == TXQ_INPUT ? &txInputMsg : &txq[txCur].msg;
+	} else if (txCur == TXQ_INPUT) {
+		//Back to the level on the bus while waiting, nothing to send anymore
+		if (!bitRead(pending, txInput)) {
+			txCur = 0xff;
+			return;
+		}
+		//Built again on every attempt to carry the latest level
+		txLevel = bitRead(txBlip, txInput) ? !bitRead(txBus, txInput) : bitRead(pinrun.sent, txInput);
+		inputReport(txInput, txLevel, &txInputMsg);
+		msg = &txInputMsg;
+	} else
+		msg = &txq[txCur].msg;
+
+	status = halLnSend(msg, txPrio);
+	txPending = status == LN_TX_PENDING;
+	if (txPending)
+		return;
+	switch (status) {
+	case LN_DONE:
+		TRACE_PACKET(TR_TX, msg->data, getLnMsgSize(msg));
+		break;
+	case LN_CD_BACKOFF:
+	case LN_PRIO_BACKOFF:
+	case LN_NETWORK_BUSY:
+		//Bus not free yet, try again on the next call
+		return;
+	default:
+		//Collision or error, retry with a shorter priority delay like LocoNet.send()
+		diag.txRetries++;
+		if (++txTries < TX_TRIES) {
+			if (txPrio > LN_BACKOFF_MIN)
+				txPrio--;
+			return;
+		}
+		diag.txDrops++;
+
+		//An input report stays pending, the bus never saw that level: it starts over
+		if (txCur == TXQ_INPUT) {
+			txCur = 0xff;
+			return;
+		}
+		break;
+	}
+
+	if (txCur == TXQ_INPUT) {
+		bitWrite(txBus, txInput, txLevel);
+		bitClear(txBlip, txInput);
+	} else
+		txq[txCur].used = false;
+	txCur = 0xff;
+}
+
+//Value of SV n, the diagnostic counters follow the table at SV_DIAG
+uint8_t readSV(uint8_t n) {
+	uint8_t value;
+
+	readSVs(n, &value, 1);
+	return (value);
+}
+
+//Low byte first at p, returns the byte after it
+uint8_t *putDiagWord(uint8_t *p, uint16_t value) {
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+	return (p + 2);
+}
+
+//SV n to n + count - 1 into buf, 0 past the table and the counters. The counters are
+//copied byte by byte, DIAG has padding on the host, and all at once with interrupts off,
+//so both bytes of a counter an ISR updates belong together when read in one request
+void readSVs(uint16_t n, uint8_t *buf, uint8_t count) {
+	uint8_t i, oldSREG, counters[SV_DIAG_SIZE], *p;
+
+	if (n < SV_DIAG + SV_DIAG_SIZE && n + count > SV_DIAG) {
+		oldSREG = halLock();
+		p = putDiagWord(counters, diag.edgeOverflow);
+		*p++ = diag.edgeHighWater;
+		*p++ = diag.edgeLatency;
+		*p++ = diag.rxBacklog;
+		p = putDiagWord(p, diag.rxBudgetHits);
+		*p++ = diag.txDepth;
+		p = putDiagWord(p, diag.txDrops);
+		p = putDiagWord(p, diag.txRetries);
+		p = putDiagWord(p, diag.eeWrites);
+		p = putDiagWord(p, diag.eeSkips);
+		putDiagWord(p, diag.eeCommits);
+		halUnlock(oldSREG);
+	}
+	for (i = 0; i < count; i++, n++) {
+		if (n < SV_SIZE)
+			buf[i] = svtable.data[n];
+		else if (n >= SV_DIAG && n < SV_DIAG + SV_DIAG_SIZE)
+			buf[i] = counters[n - SV_DIAG];
+		else
+			buf[i] = 0;
+	}
+}
+
+//Load the newest valid record of the journal into svtable, false if there is none
+boolean loadConfig() {
+	uint8_t n, slot, round, seq;
+	uint8_t index[JR_SLOTS + 2], rec[3];
+	uint16_t crc, tried;
+	uint16_t addr;
+
+	//Index and magic in one read, then a single read per record
+	halEeRead(JR_INDEX, index, sizeof(index));
+
+	//First boot with the journal: set it up, keeping a config of the old layout (table at 0)
+	if (index[JR_SLOTS] != 'L' || index[JR_SLOTS + 1] != 'J') {
+		for (n = 0; n < JR_SLOTS; n++) {
+			halEeUpdate(JR_INDEX + n, 0xff);
+			index[n] = 0xff;
+		}
+		halEeUpdate(JR_MAGIC, 'L');
+		halEeUpdate(JR_MAGIC + 1, 'J');
+	}
+
+	//Newest sequence first, older ones if its record is damaged
+	tried = 0;
+	for (round = 0; round < JR_SLOTS; round++) {
+		slot = 0xff;
+		for (n = 0; n < JR_SLOTS; n++) {
+			seq = index[n];
+			if (seq == 0xff || bitRead(tried, n))
+				continue;
+			if (slot == 0xff || (int8_t) (seq - eeSeq) > 0) {
+				slot = n;
+				eeSeq = seq;
+			}
+		}
+		if (slot == 0xff)
+			break;
+		bitSet(tried, slot);
+
+		addr = slot * JR_REC;
+		halEeRead(addr + 1, svtable.data, SV_SIZE);
+		rec[0] = halEeReadByte(addr);
+		halEeRead(addr + JR_REC - 2, &rec[1], 2);
+		if (rec[0] != eeSeq)
+			continue;
+		crc = _crc16_update(0xffff, eeSeq);
+		for (n = 0; n < SV_SIZE; n++)
+			crc = _crc16_update(crc, svtable.data[n]);
+		if (rec[1] == (uint8_t) crc && rec[2] == (crc >> 8)) {
+			eeNewest = slot;
+			return (true);
+		}
+	}
+
+	//Nothing committed yet, the old layout is in slot 0 so the first commit goes to slot 1
+	eeSeq = 0xfe;
+	eeNewest = 0;
+	if (tried || halEeReadByte(0) != VERSION)
+		return (false);
+	halEeRead(0, svtable.data, SV_SIZE);
+	eePending = true;
+	return (true);
+}
+
+//Change SV n, it is committed to EEPROM later from the EE_READY interrupt
+void writeSV(uint8_t n, uint8_t value) {
+	uint8_t oldSREG;
+
+	svtable.data[n] = value;
+
+	//Stop a commit in progress, it starts over once the SV writes are quiet again
+	oldSREG = halLock();
+	eePending = true;
+	eeBusy = false;
+	halEeReady(false);
+	halUnlock(oldSREG);
+	eeLastWrite = millis();
+}
+
+//Start a commit once the SV writes are quiet, the EE_READY interrupt does the rest
+void eeService() {
+	if (!eePending || eeBusy || (uint16_t) ((uint16_t) millis() - eeLastWrite) < EE_QUIET_MS)
+		return;
+
+	eeSlot = eeNewest + 1;
+	if (eeSlot >= JR_SLOTS)
+		eeSlot = 0;
+	eePos = 0;
+	eeBusy = true;
+	halEeReady(true);
+}
+
+//EEPROM ready for the next write: handle the next byte of the record and return.
+//One byte per interrupt, even when the slot already has it and nothing is written:
+//EE_READY fires again at once while the EEPROM is idle, and the LocoNet interrupts get
+//in between. svtable is only read here and a commit is stopped by any SV write, so the
+//record always holds one consistent table
+void eeReady() {
+	uint8_t value, seq;
+	uint16_t addr;
+
+	seq = eeSeq + 1 < 0xff ? eeSeq + 1 : 0;
+	if (eePos > JR_REC) {
+		//Record committed, the index byte is written
+		halEeReady(false);
+		eeNewest = eeSlot;
+		eeSeq = seq;
+		eePending = false;
+		eeBusy = false;
+		diag.eeCommits++;
+		return;
+	}
+
+	if (eePos == 0) {
+		value = seq;
+		eeCrc = _crc16_update(0xffff, value);
+	} else if (eePos <= SV_SIZE) {
+		value = svtable.data[eePos - 1];
+		eeCrc = _crc16_update(eeCrc, value);
+	} else if (eePos == SV_SIZE + 1)
+		value = eeCrc;
+	else if (eePos == SV_SIZE + 2)
+		value = eeCrc >> 8;
+	else
+		value = seq;   //Index last, it makes the record valid
+
+	addr = eePos < JR_REC ? eeSlot * JR_REC + eePos : JR_INDEX + eeSlot;
+	eePos++;
+
+	if (halEeReadByte(addr) == value) {
+		diag.eeSkips++;
+		return;
+	}
+	halEeWrite(addr, value);
+	diag.eeWrites++;
+}
+
+//Build the index of switch addresses from the outputs config
+void buildSwitchIndex() {
+	uint8_t n;
+
+	memset(swUsed, 0, sizeof(swUsed));
+	swCount = 0;
+	for (n = 0; n < 16; n++) {
+		if (bitRead(pinrun.output, n))   //Inputs have no switch address
+			switchIndexAdd(n);
+	}
+}
+void switchIndexAdd(uint8_t n) {
+	uint8_t i, addr = svtable.svt.pincfg[n].value1;
+
+	for (i = 0; i < swCount && swIdx[i].addr != addr; i++)
+		;
+	if (i == swCount) {
+		swIdx[swCount].addr = addr;
+		swIdx[swCount].pins = 0;
+		swCount++;
+		bitSet(swUsed[addr >> 3], addr & 7);
+	}
+	bitSet(swIdx[i].pins, n);
+}
+void switchIndexRemove(uint8_t n) {
+	uint8_t i;
+
+	for (i = 0; i < swCount && !bitRead(swIdx[i].pins, n); i++)
+		;
+	if (i == swCount)
+		return;
+	bitClear(swIdx[i].pins, n);
+	if (swIdx[i].pins)
+		return;
+
+	//Last output of this address, the last entry takes its place
+	bitClear(swUsed[swIdx[i].addr >> 3], swIdx[i].addr & 7);
+	swIdx[i] = swIdx[--swCount];
+}
+
+//Outputs assigned to a switch Address, 0 if it is not for this module
+uint16_t switchPins(uint16_t Address) {
+	uint8_t i, addr;
+
+	//Outputs only store 8 bits of the address
+	if (Address == 0 || Address > 256)
+		return (0);
+	addr = Address - 1;
+	if (!bitRead(swUsed[addr >> 3], addr & 7))
+		return (0);
+
+	for (i = 0; swIdx[i].addr != addr; i++)
+		;
+	return (swIdx[i].pins);
+}
+
+//Pulse length in ms of output n
+uint16_t pulseLength(uint8_t n) {
+	uint8_t units = svtable.svt.pulse[n];
+
+	if (units == 0 || units == 0xff)
+		return (PULSE_MS);
+	return (units * PULSE_UNIT_MS);
+}
+
+//Start (or restart) the timer of a slot to expire ms milliseconds from now
+void timerArm(uint8_t slot, uint16_t ms) {
+	uint16_t deadline = (uint16_t) millis() + ms;
+
+	if (!tmrArmed || (int16_t) (deadline - tmrNext) < 0)
+		tmrNext = deadline;
+	tmrDeadline[slot] = deadline;
+	bitSet(tmrArmed, slot);
+}
+
+//Stop the timers of the slots in mask slots
+void timerCancel(uint32_t slots) {
+	tmrArmed &= ~slots;
+}
+
+//Return the slots whose deadline has passed and disarm them
+uint32_t timerExpired() {
+	uint16_t now;
+	uint32_t expired = 0;
+	uint8_t n;
+
+	//Nothing pending or nothing due yet
+	now = millis();
+	if (!tmrArmed || (int16_t) (now - tmrNext) < 0)
+		return (0);
+
+	tmrNext = now + 0x7fff;
+	for (n = 0; n < TMR_SLOTS; n++) {
+		if (!bitRead(tmrArmed, n))
+			continue;
+		if ((int16_t) (now - tmrDeadline[n]) >= 0)
+			bitSet(expired, n);
+		else if ((int16_t) (tmrDeadline[n] - tmrNext) < 0)
+			tmrNext = tmrDeadline[n];
+	}
+	tmrArmed &= ~expired;
+
+	return (expired);
+}
@@ -0,0 +1,123 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *************************************************************************/
+
+#include "Trace.h"
+
+#if TRACE_LEVEL >= 1
+
+FW_STATE uint8_t traceRing[TRACE_RING][TRACE_SIZE];
+FW_STATE uint8_t traceHead;      //Next record to write
+FW_STATE uint8_t traceTail;      //Record being sent
+FW_STATE uint8_t traceSent;      //Bytes of the tail record already sent
+FW_STATE uint16_t traceLost;     //Records dropped since the last TR_LOST
+FW_STATE uint32_t traceTick;     //millis() of the last TR_TICK
+
+void traceInit() {
+	halSerialBegin(57600);
+}
+
+//Records that can still be stored
+static uint8_t traceRoom() {
+	return ((traceTail - traceHead - 1) & (TRACE_RING - 1));
+}
+
+//Fill the head record and advance
+static void traceStore(uint8_t type, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {
+	uint8_t *rec, n;
+	uint16_t now;
+
+	now = millis();
+	rec = traceRing[traceHead];
+	rec[0] = type;
+	rec[1] = now;
+	rec[2] = now >> 8;
+	rec[3] = d0;
+	rec[4] = d1;
+	rec[5] = d2;
+	rec[6] = d3;
+	rec[7] = 0xff;
+	for (n = 0; n < TRACE_SIZE - 1; n++)
+		rec[7] ^= rec[n];
+	traceHead = (traceHead + 1) & (TRACE_RING - 1);
+}
+
+//Store a record, dropped if the ring is full
+void traceWrite(uint8_t type, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {
+	//Room again after losing some, say so first
+	if (traceLost && traceRoom() >= 2) {
+		traceStore(TR_LOST, traceLost, traceLost >> 8, 0, 0);
+		traceLost = 0;
+	}
+
+	if (!traceRoom()) {
+		if (traceLost != 0xffff)
+			traceLost++;
+		return;
+	}
+	traceStore(type, d0, d1, d2, d3);
+}
+
+//Store a whole packet, 4 bytes per record
+void tracePacket(uint8_t type, const uint8_t *data, uint8_t len) {
+	uint8_t n, d[4];
+
+	for (n = 0; n < len; n += 4) {
+		memset(d, 0, sizeof(d));
+		memcpy(d, data + n, len - n < 4 ? len - n : 4);
+		traceWrite(n ? TR_MORE : type, d[0], d[1], d[2], d[3]);
+	}
+}
+
+//Send what fits in the serial TX buffer without waiting
+void traceFlush() {
+	int room;
+	uint32_t now;
+
+	//The whole time now and then, the records only carry its low 16 bits
+	now = millis();
+	if (now - traceTick >= TRACE_TICK_MS) {
+		traceTick = now;
+		traceWrite(TR_TICK, now, now >> 8, now >> 16, now >> 24);
+	}
+
+	room = halSerialRoom();
+	while (room > 0 && traceTail != traceHead) {
+		halSerialWrite(traceRing[traceTail][traceSent]);
+		room--;
+		if (++traceSent == TRACE_SIZE) {
+			traceSent = 0;
+			traceTail = (traceTail + 1) & (TRACE_RING - 1);
+		}
+	}
+}
+
+#else
+
+void traceInit() {
+}
+
+void traceWrite(uint8_t type, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {
+}
+
+void tracePacket(uint8_t type, const uint8_t *data, uint8_t len) {
+}
+
+void traceFlush() {
+}
+
+#endif
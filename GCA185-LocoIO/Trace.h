@@ -0,0 +1,87 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Binary trace of what the module does, replacing the debug prints.
+ Records of TRACE_SIZE bytes are stored in a RAM ring and sent to the
+ serial port (57600 baud) from traceFlush() only while there is room in
+ the serial TX buffer, so tracing never waits on the UART. When the ring
+ is full new records are dropped and counted in a TR_LOST record.
+ Decode the stream with tools/locoino_trace.py.
+
+ Record: type, time (ms, low byte first), 4 data bytes, check byte
+         (0xFF xor all the other bytes).
+ The time of a record is the low 16 bits of millis(), it wraps every 65.5 s.
+ A TR_TICK with the whole of millis() is stored every TRACE_TICK_MS, so a
+ reader keeps the time across quiet periods of any length.
+ *************************************************************************/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "Hal.h"
+
+//Trace level: 0 none (no serial port at all), 1 events, 2 events, every packet and input edge
+//(what host/LocoInoReplay.cpp needs to replay a session)
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 1
+#endif
+
+//Records kept in RAM until sent, power of 2
+#define TRACE_RING 16
+#define TRACE_SIZE 8
+//Time between two TR_TICK records
+#define TRACE_TICK_MS 10000
+
+//Record types, data bytes in brackets
+#define TR_BOOT 1      //Start up [version, addr_low, addr_high, -]
+#define TR_LOST 2      //Records dropped, ring full [count low, count high, -, -]
+#define TR_INPUT 3     //Input reported [input, level, in1, in2]
+#define TR_SWREQ 4     //Switch request for my outputs [address low, address high, output, direction]
+#define TR_SVWRITE 5   //SV written [sv, value, -, -]
+#define TR_RX 6        //Packet received [first 4 bytes], followed by TR_MORE
+#define TR_TX 7        //Packet sent [first 4 bytes], followed by TR_MORE
+#define TR_MORE 8      //Next 4 bytes of the packet in the previous record
+#define TR_SENSOR 9    //Sensor report on the bus [address low, address high, state, -]
+#define TR_SWREP 10    //Switch report on the bus [address low, address high, output, direction]
+#define TR_SWSTATE 11  //Switch state on the bus [address low, address high, output, direction]
+#define TR_EDGE 12     //Input edge captured [levels low, levels high, time low, time high], time of the capture
+#define TR_TICK 13     //Time [millis(), low byte first]
+
+#if TRACE_LEVEL >= 1
+#define TRACE(type, d0, d1, d2, d3) traceWrite(type, d0, d1, d2, d3)
+#else
+#define TRACE(type, d0, d1, d2, d3)
+#endif
+
+#if TRACE_LEVEL >= 2
+#define TRACE_PACKET(type, data, len) tracePacket(type, data, len)
+#define TRACE_BUS(type, d0, d1, d2, d3) traceWrite(type, d0, d1, d2, d3)
+#define TRACE_EDGE(inputs, time) traceWrite(TR_EDGE, inputs, (inputs) >> 8, time, (time) >> 8)
+#else
+#define TRACE_PACKET(type, data, len)
+#define TRACE_BUS(type, d0, d1, d2, d3)
+#define TRACE_EDGE(inputs, time)
+#endif
+
+void traceInit();
+void traceWrite(uint8_t type, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3);
+void tracePacket(uint8_t type, const uint8_t *data, uint8_t len);
+void traceFlush();
+
+#endif /* TRACE_H_ */
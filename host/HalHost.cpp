@@ -0,0 +1,194 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Linux host backend of the HAL, see HalHost.h.
+ *************************************************************************/
+
+#include "Hal.h"
+
+FW_STATE HOST host;
+
+void hostInit() {
+	memset(&host, 0, sizeof(host));
+	memset(host.eeprom, 0xff, sizeof(host.eeprom));
+	host.pins = 0xffff;
+	host.seed = 1;
+}
+
+//Move the clock, the EEPROM interrupt runs once a byte write is done
+void hostAdvance(uint32_t us) {
+	host.time += us;
+	while (host.eeReady && host.time >= host.eeFree)
+		eeReady();
+}
+
+//Drive the inputs from outside (1 = high, free), like the pin change interrupts
+void hostSetInputs(uint16_t levels) {
+	uint16_t before;
+
+	before = halReadInputs();
+	host.pins = levels;
+	if ((before ^ halReadInputs()) & host.edgeMask)
+		captureEdge();
+}
+
+//Level of the pins configured as outputs
+uint16_t hostOutputs() {
+	return (host.port & host.ddr);
+}
+
+//Packet from the bus, false if the receive ring is full. board is &host, or
+//the HOST of a board whose state is not swapped in
+boolean hostReceive(HOST *board, const uint8_t *data, uint8_t len) {
+	uint8_t next;
+
+	next = (board->rxHead + 1) & (HOST_RX_RING - 1);
+	if (next == board->rxTail || len > sizeof(lnMsg))
+		return (false);
+	memset(&board->rx[board->rxHead], 0, sizeof(lnMsg));
+	memcpy(board->rx[board->rxHead].data, data, len);
+	board->rxHead = next;
+	return (true);
+}
+
+uint32_t millis() {
+	return ((uint32_t) (host.time / 1000));
+}
+
+uint32_t micros() {
+	return ((uint32_t) host.time);
+}
+
+//xorshift32, the same sequence for the same seed on every run
+long random(long howbig) {
+	if (howbig <= 0)
+		return (0);
+	host.seed ^= host.seed << 13;
+	host.seed ^= host.seed >> 17;
+	host.seed ^= host.seed << 5;
+	return (host.seed % howbig);
+}
+
+void randomSeed(unsigned long seed) {
+	if (seed != 0)
+		host.seed = seed;
+}
+
+uint8_t getLnMsgSize(const lnMsg *msg) {
+	return ((msg->sz.command & 0x60) == 0x60 ? msg->sz.mesg_size : ((msg->sz.command & 0x60) >> 4) + 2);
+}
+
+uint16_t halReadInputs() {
+	return ((host.ddr & host.port) | (~host.ddr & host.pins));
+}
+
+void halWriteOutputs(uint16_t on, uint16_t off) {
+	host.port = (host.port | on) & ~(off & ~on);
+}
+
+void halConfigurePins(uint16_t pins, uint16_t outputs) {
+	host.port = (host.port & ~pins) | (~outputs & pins);
+	host.ddr = (host.ddr & ~pins) | (outputs & pins);
+}
+
+void halEdgeCapture(uint16_t inputs) {
+	host.edgeMask = inputs;
+}
+
+void halEeRead(uint16_t addr, void *buf, uint16_t len) {
+	memcpy(buf, &host.eeprom[addr], len);
+}
+
+uint8_t halEeReadByte(uint16_t addr) {
+	return (host.eeprom[addr]);
+}
+
+//Waits for the write like eeprom_update_byte()
+void halEeUpdate(uint16_t addr, uint8_t value) {
+	if (host.eeprom[addr] == value)
+		return;
+	host.eeprom[addr] = value;
+	host.time += HOST_EE_WRITE_US;
+}
+
+void halEeReady(boolean on) {
+	host.eeReady = on;
+}
+
+void halEeWrite(uint16_t addr, uint8_t value) {
+	host.eeprom[addr] = value;
+	host.eeFree = host.time + HOST_EE_WRITE_US;
+}
+
+void halLnInit() {
+	host.rxHead = host.rxTail = 0;
+}
+
+lnMsg *halLnReceive() {
+	if (host.rxTail == host.rxHead)
+		return (NULL);
+	host.rxMsg = host.rx[host.rxTail];
+	host.rxTail = (host.rxTail + 1) & (HOST_RX_RING - 1);
+	return (&host.rxMsg);
+}
+
+LN_STATUS halLnSend(lnMsg *msg, uint8_t prioDelay) {
+	if (!host.send)
+		return (LN_DONE);
+	return (host.send(msg, prioDelay));
+}
+
+//Same decoding as LocoNet.processSwitchSensorMessage()
+void halLnSwitchSensor(lnMsg *msg) {
+	uint16_t addr;
+	uint8_t sw2;
+
+	sw2 = msg->srq.sw2;
+	addr = msg->srq.sw1 | ((sw2 & 0x0f) << 7);
+	switch (msg->sz.command) {
+	case OPC_INPUT_REP:
+		addr = (addr << 1) + (sw2 & OPC_INPUT_REP_SW ? 2 : 1);
+		notifySensor(addr, sw2 & OPC_INPUT_REP_HI);
+		break;
+	case OPC_SW_REQ:
+		notifySwitchRequest(addr + 1, sw2 & OPC_SW_REQ_OUT, sw2 & OPC_SW_REQ_DIR);
+		break;
+	case OPC_SW_REP:
+		//Output reports (notifySwitchOutputsReport) are not used by the sketch
+		if (sw2 & OPC_SW_REP_INPUTS)
+			notifySwitchReport(addr + 1, sw2 & OPC_SW_REP_HI, sw2 & OPC_SW_REP_SW);
+		break;
+	case OPC_SW_STATE:
+		notifySwitchState(addr + 1, sw2 & OPC_SW_REQ_OUT, sw2 & OPC_SW_REQ_DIR);
+		break;
+	}
+}
+
+void halSerialBegin(uint32_t baud) {
+	(void) baud;
+}
+
+//The host never waits on the serial port
+int halSerialRoom() {
+	return (64);
+}
+
+void halSerialWrite(uint8_t b) {
+	if (host.serial)
+		fputc(b, host.serial);
+}
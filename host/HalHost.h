@@ -0,0 +1,204 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Linux host backend of the HAL (see GCA185-LocoIO/Hal.h). The board is
+ simulated in the HOST struct: a virtual clock, the pins, the EEPROM and
+ a LocoNet endpoint. Nothing moves by itself, the program running the
+ sketch (host/LocoInoHost.cpp) advances the clock, drives the inputs and
+ passes the packets in and out through the host*() functions.
+
+ The globals of the sketch and the HOST struct are FW_STATE: a program
+ running many boards keeps a copy of the section for each one.
+
+ Interrupts do not exist on the host: captureEdge() is called by
+ hostSetInputs() and eeReady() by hostAdvance(), always between two calls
+ of loop(), so halLock() has nothing to do.
+ *************************************************************************/
+
+#ifndef HALHOST_H_
+#define HALHOST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+//Section of all the globals of the sketch, __start_fw_state/__stop_fw_state give its bounds
+#define FW_STATE __attribute__((section("fw_state")))
+
+extern uint8_t __start_fw_state[], __stop_fw_state[];
+
+//Arduino core
+typedef bool boolean;
+
+#define bit(b) (1UL << (b))
+#define bitRead(value, b) (((value) >> (b)) & 0x01)
+#define bitSet(value, b) ((value) |= (1UL << (b)))
+#define bitClear(value, b) ((value) &= ~(1UL << (b)))
+#define bitWrite(value, b, bitvalue) ((bitvalue) ? bitSet(value, b) : bitClear(value, b))
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+
+uint32_t millis();
+uint32_t micros();
+long random(long howbig);
+void randomSeed(unsigned long seed);
+
+//avr-libc: ATmega328 EEPROM size and util/crc16.h
+#define E2END 0x3ff
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+	int i;
+
+	crc ^= a;
+	for (i = 0; i < 8; i++) {
+		if (crc & 1)
+			crc = (crc >> 1) ^ 0xa001;
+		else
+			crc = (crc >> 1);
+	}
+	return (crc);
+}
+
+//LocoNet library (ln_opc.h), the part used by the sketch
+#define OPC_SW_REQ 0xb0
+#define OPC_SW_REP 0xb1
+#define OPC_INPUT_REP 0xb2
+#define OPC_SW_STATE 0xbc
+#define OPC_PEER_XFER 0xe5
+
+#define OPC_SW_REQ_DIR 0x20
+#define OPC_SW_REQ_OUT 0x10
+#define OPC_SW_REP_SW 0x20
+#define OPC_SW_REP_HI 0x10
+#define OPC_SW_REP_INPUTS 0x40
+#define OPC_INPUT_REP_SW 0x20
+#define OPC_INPUT_REP_HI 0x10
+
+typedef struct {
+	uint8_t command, mesg_size, src, dst_l, dst_h, pxct1, d1, d2, d3, d4, pxct2, d5, d6, d7, d8, chksum;
+} peerXferMsg;
+
+typedef struct {
+	uint8_t command, sw1, sw2, chksum;
+} swReqMsg;
+
+typedef struct {
+	uint8_t command, in1, in2, chksum;
+} inputRepMsg;
+
+typedef struct {
+	uint8_t command, mesg_size;
+} szMsg;
+
+typedef union {
+	szMsg sz;
+	peerXferMsg px;
+	swReqMsg srq;
+	inputRepMsg ir;
+	uint8_t data[16];
+} lnMsg;
+
+typedef enum {
+	LN_CD_BACKOFF = 0, LN_PRIO_BACKOFF, LN_NETWORK_BUSY, LN_DONE, LN_COLLISION, LN_UNKNOWN_ERROR, LN_RETRY_ERROR
+} LN_STATUS;
+
+//Priority delays of sendLocoNetPacketTry() in bit times, as in ln_sw_uart.h
+#define LN_CARRIER_TICKS 20       //Carrier detect backoff, every device waits this
+#define LN_MASTER_DELAY 6         //Devices other than the command station wait this as well
+#define LN_INITIAL_PRIO_DELAY 20  //Added on the first attempt
+#define LN_BACKOFF_MIN (LN_CARRIER_TICKS + LN_MASTER_DELAY)
+#define LN_BACKOFF_INITIAL (LN_BACKOFF_MIN + LN_INITIAL_PRIO_DELAY)
+#define LN_BACKOFF_MAX (LN_BACKOFF_INITIAL + 10)
+
+uint8_t getLnMsgSize(const lnMsg *msg);
+
+//Callbacks of halLnSwitchSensor(), in the sketch
+void notifySensor(uint16_t Address, uint8_t State);
+void notifySwitchRequest(uint16_t Address, uint8_t Output, uint8_t Direction);
+void notifySwitchReport(uint16_t Address, uint8_t Output, uint8_t Direction);
+void notifySwitchState(uint16_t Address, uint8_t Output, uint8_t Direction);
+
+//Sketch entry points
+void setup();
+void loop();
+
+//State of the simulated board
+#define HOST_RX_RING 16       //Packets received and not read yet, power of 2
+#define HOST_EE_WRITE_US 3400 //Time of an EEPROM byte write
+
+typedef struct {
+	uint64_t time;            //Virtual clock, us
+	uint32_t seed;            //random() state
+
+	uint16_t ddr;             //1 = output, I/O 1 in bit 0
+	uint16_t port;            //Output level or pull-up
+	uint16_t pins;            //Level driven from outside on the inputs
+	uint16_t edgeMask;        //Inputs calling captureEdge()
+
+	uint8_t eeprom[E2END + 1];
+	boolean eeReady;          //eeReady() called whenever the EEPROM is free
+	uint64_t eeFree;          //Time the byte being written is done
+
+	lnMsg rx[HOST_RX_RING];
+	uint8_t rxHead, rxTail;
+	lnMsg rxMsg;              //Packet returned by halLnReceive()
+	//Send attempt (see halLnSend()), LN_DONE if not set (packet lost)
+	LN_STATUS (*send)(lnMsg *msg, uint8_t prioDelay);
+
+	FILE *serial;             //Serial port output, NULL to drop it
+} HOST;
+
+extern HOST host;
+
+void hostInit();
+void hostAdvance(uint32_t us);
+void hostSetInputs(uint16_t levels);
+uint16_t hostOutputs();
+boolean hostReceive(HOST *board, const uint8_t *data, uint8_t len);
+
+//HAL, see Hal.h
+static inline uint8_t halLock() {
+	return (0);
+}
+static inline void halUnlock(uint8_t state) {
+	(void) state;
+}
+
+uint16_t halReadInputs();
+void halWriteOutputs(uint16_t on, uint16_t off);
+void halConfigurePins(uint16_t pins, uint16_t outputs);
+void halEdgeCapture(uint16_t inputs);
+
+void halEeRead(uint16_t addr, void *buf, uint16_t len);
+uint8_t halEeReadByte(uint16_t addr);
+void halEeUpdate(uint16_t addr, uint8_t value);
+void halEeReady(boolean on);
+void halEeWrite(uint16_t addr, uint8_t value);
+
+void halLnInit();
+lnMsg *halLnReceive();
+LN_STATUS halLnSend(lnMsg *msg, uint8_t prioDelay);
+void halLnSwitchSensor(lnMsg *msg);
+
+void halSerialBegin(uint32_t baud);
+int halSerialRoom();
+void halSerialWrite(uint8_t b);
+
+#endif /* HALHOST_H_ */
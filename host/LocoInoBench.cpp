@@ -0,0 +1,383 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Micro-benchmarks of the hot paths of the sketch on the host build, one
+ board with outputs 1-8 on switch addresses 1-8 and inputs 9-16:
+   loop_idle       loop() with nothing to do, 50 us of virtual time each
+   loop_rx         loop() with a packet received every time, a mix of
+                   layout traffic (throttles, reports, requests mostly for
+                   other modules, an SV read for this one now and then)
+   swreq_match     notifySwitchRequest() of one of our addresses
+   swreq_miss      notifySwitchRequest() of an address of another module
+   peer_sv_read    processPeerPacket() of an SV read, then txService()
+                   sending the reply
+   peer_sv_write   processPeerPacket() of an SV write (debounce of an
+                   input, so the pin is set up again), then its reply
+   peer_pack       sendPeerPacket() packing a reply, then txService()
+ The peer benchmarks copy the request to LnPacket first, it is changed in
+ place.
+
+ Every benchmark runs -r times for -m ms at least, the best run gives its
+ ns/op. Allocations are counted through malloc() while it runs, the
+ sketch makes none and should stay so.
+
+ Usage: locoino_bench [-r runs] [-m ms] [-b baseline.json] [-o out.json] [-t percent]
+   -b file   compare with a baseline, exit status 1 when a benchmark is
+             more than -t percent (default 20) slower or allocates more
+   -o file   write the results as JSON, to be used as a baseline later
+ The JSON names the machine it was measured on (CPU, system, compiler).
+ host/LocoInoBench.json is the baseline of the tree, compare with it on
+ that machine only: timings depend on it. Elsewhere write one with -o
+ before changing the code and compare with -b after.
+ *************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include "Hal.h"
+
+//Inside the sketch
+extern lnMsg *LnPacket;
+boolean processPeerPacket();
+void sendPeerPacket(uint8_t p0, uint8_t p1, uint8_t p2);
+void programSV(uint8_t n, uint8_t value);
+void txService();
+
+#define BOARD_ADDR 81        //Default address after a blank EEPROM, high byte 1
+#define MAX_RESULTS 16
+#define MACHINE_SIZE 192
+
+typedef struct {
+	const char *name;
+	void (*op)(uint32_t i);
+} BENCH;
+
+typedef struct {
+	char name[32];
+	double ns;
+	double allocs;
+} RESULT;
+
+uint32_t allocCount;
+
+//Count the allocations, glibc does the work
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size) {
+	allocCount++;
+	return (__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+	allocCount++;
+	return (__libc_calloc(n, size));
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+	allocCount++;
+	return (__libc_realloc(ptr, size));
+}
+
+//Packets of loop_rx, the checksum is added at start
+uint8_t rxMix[][16] = {
+	{ 0xa0, 0x03, 0x40 },                               //OPC_LOCO_SPD
+	{ 0xb2, 0x21, 0x50 },                               //OPC_INPUT_REP, other module
+	{ 0xa1, 0x03, 0x10 },                               //OPC_LOCO_DIRF
+	{ 0xb0, 0x40, 0x30 },                               //OPC_SW_REQ 65, other module
+	{ 0x81 },                                           //OPC_BUSY
+	{ 0xa0, 0x07, 0x22 },
+	{ 0xb2, 0x22, 0x40 },
+	{ 0xb0, 0x02, 0x30 },                               //OPC_SW_REQ 3, ours
+	{ 0xa2, 0x03, 0x01 },                               //OPC_LOCO_SND
+	{ 0xb1, 0x40, 0x70 },                               //OPC_SW_REP
+	{ 0xa0, 0x03, 0x41 },
+	{ 0xb2, 0x23, 0x50 },
+	{ 0xe5, 0x10, 0x50, BOARD_ADDR, 0x01, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 },  //SV 3 read
+	{ 0xb0, 0x02, 0x20 },
+	{ 0xa1, 0x07, 0x00 },
+	{ 0xbc, 0x10, 0x00 }                                //OPC_SW_STATE
+};
+
+#define RX_MIX (sizeof(rxMix) / sizeof(rxMix[0]))
+
+uint8_t svRead[16] = { 0xe5, 0x10, 0x50, BOARD_ADDR, 0x01, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 };
+uint8_t svWrite[16] = { 0xe5, 0x10, 0x50, BOARD_ADDR, 0x01, 0x00, 0x01, 75, 0x00, 0x02, 0x00, 0x01, 0x00, 0x00, 0x00 };
+lnMsg request;
+
+static void checksum(uint8_t *data) {
+	uint8_t n, len, sum = 0xff;
+
+	len = getLnMsgSize((const lnMsg *) data);
+	for (n = 0; n < len - 1; n++)
+		sum ^= data[n];
+	data[len - 1] = sum;
+}
+
+static void loopIdle(uint32_t i) {
+	hostAdvance(50);
+	loop();
+}
+
+static void loopRx(uint32_t i) {
+	hostReceive(&host, rxMix[i % RX_MIX], getLnMsgSize((const lnMsg *) rxMix[i % RX_MIX]));
+	hostAdvance(50);
+	loop();
+}
+
+static void swreqMatch(uint32_t i) {
+	notifySwitchRequest(1 + (i & 7), i & 8, i & 16);
+}
+
+static void swreqMiss(uint32_t i) {
+	notifySwitchRequest(20 + (i & 63), i & 8, i & 16);
+}
+
+static void peerSvRead(uint32_t i) {
+	memcpy(&request, svRead, sizeof(request));
+	request.px.d2 = 3 + (i & 31);
+	LnPacket = &request;
+	processPeerPacket();
+	txService();
+}
+
+static void peerSvWrite(uint32_t i) {
+	memcpy(&request, svWrite, sizeof(request));
+	request.px.d4 = 2 + (i & 1);
+	LnPacket = &request;
+	processPeerPacket();
+	txService();
+}
+
+static void peerPack(uint32_t i) {
+	memcpy(&request, svRead, sizeof(request));
+	LnPacket = &request;
+	sendPeerPacket(i, i >> 8, i | 0x80);
+	txService();
+}
+
+BENCH benches[] = {
+	{ "loop_idle", loopIdle },
+	{ "loop_rx", loopRx },
+	{ "swreq_match", swreqMatch },
+	{ "swreq_miss", swreqMiss },
+	{ "peer_sv_read", peerSvRead },
+	{ "peer_sv_write", peerSvWrite },
+	{ "peer_pack", peerPack }
+};
+
+#define BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static double realTime() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+//Board with outputs 1-8 on switch addresses 1-8, inputs 9-16 on sensors 1-8.
+//Every pin SV is written, the other SVs keep the defaults of a blank EEPROM
+static void boardInit() {
+	uint8_t n;
+
+	hostInit();
+	setup();
+	for (n = 0; n < 8; n++) {
+		programSV(3 + 3 * n, 0x80);
+		programSV(3 + 3 * n + 1, n);
+		programSV(3 + 3 * n + 2, 0);
+		programSV(3 + 3 * (n + 8), 0x00);
+		programSV(3 + 3 * (n + 8) + 1, n >> 1);
+		programSV(3 + 3 * (n + 8) + 2, (n & 1) << 5);
+	}
+	//Let the SVs go to the EEPROM
+	for (n = 0; n < 100; n++) {
+		hostAdvance(20000);
+		loop();
+	}
+}
+
+//Best ns/op of runs
+static void measure(BENCH *bench, int runs, double minMs, RESULT *res) {
+	uint32_t i, count;
+	uint64_t ops, allocs;
+	double start, elapsed, best;
+	int run;
+
+	best = 1e30;
+	ops = allocs = 0;
+	boardInit();
+	for (i = 0; i < 10000; i++)
+		bench->op(i);
+	for (run = 0; run < runs; run++) {
+		count = 0;
+		allocCount = 0;
+		start = realTime();
+		do {
+			for (i = 0; i < 10000; i++)
+				bench->op(count + i);
+			count += i;
+			elapsed = realTime() - start;
+		} while (elapsed * 1000 < minMs);
+		if (elapsed * 1e9 / count < best)
+			best = elapsed * 1e9 / count;
+		allocs += allocCount;
+		ops += count;
+	}
+	res->allocs = (double) allocs / ops;
+	snprintf(res->name, sizeof(res->name), "%s", bench->name);
+	res->ns = best;
+}
+
+//CPU, system and compiler of the results
+static void machineName(char *buf) {
+	FILE *f;
+	char line[256], cpu[96], *p;
+	struct utsname u;
+
+	snprintf(cpu, sizeof(cpu), "unknown CPU");
+	f = fopen("/proc/cpuinfo", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			p = strchr(line, ':');
+			if (!strncmp(line, "model name", 10) && p) {
+				snprintf(cpu, sizeof(cpu), "%s", p + 2);
+				cpu[strcspn(cpu, "\n")] = 0;
+				break;
+			}
+		}
+		fclose(f);
+	}
+	if (uname(&u) < 0)
+		memset(&u, 0, sizeof(u));
+	snprintf(buf, MACHINE_SIZE, "%.60s, %.16s %.40s %.16s, compiler %.20s", cpu, u.sysname, u.release, u.machine, __VERSION__);
+}
+
+//Baseline written by writeJson(), false if it cannot be read
+static boolean readJson(const char *file, RESULT *base, int *count, char *machine) {
+	FILE *f;
+	char line[256];
+	RESULT r;
+
+	f = fopen(file, "r");
+	if (!f)
+		return (false);
+	*count = 0;
+	snprintf(machine, MACHINE_SIZE, "unknown machine");
+	while (fgets(line, sizeof(line), f) && *count < MAX_RESULTS) {
+		if (sscanf(line, " \"%31[^\"]\": { \"ns\": %lf, \"allocs\": %lf", r.name, &r.ns, &r.allocs) == 3)
+			base[(*count)++] = r;
+		else
+			sscanf(line, " \"machine\": \"%191[^\"]\"", machine);
+	}
+	fclose(f);
+	return (true);
+}
+
+static boolean writeJson(const char *file, RESULT *res, int count, const char *machine) {
+	FILE *f;
+	int n;
+
+	f = fopen(file, "w");
+	if (!f)
+		return (false);
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"machine\": \"%s\",\n", machine);
+	for (n = 0; n < count; n++)
+		fprintf(f, "\t\"%s\": { \"ns\": %.1f, \"allocs\": %.3f }%s\n", res[n].name, res[n].ns, res[n].allocs,
+				n + 1 < count ? "," : "");
+	fprintf(f, "}\n");
+	return (fclose(f) == 0);
+}
+
+int main(int argc, char **argv) {
+	int opt, runs = 5, n, b, baseCount = 0;
+	double minMs = 200, tolerance = 20, change;
+	const char *baseFile = NULL, *outFile = NULL;
+	char machine[MACHINE_SIZE], baseMachine[MACHINE_SIZE];
+	RESULT res[BENCHES], base[MAX_RESULTS];
+	boolean worse = false;
+
+	while ((opt = getopt(argc, argv, "r:m:b:o:t:")) != -1) {
+		switch (opt) {
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'm':
+			minMs = atof(optarg);
+			break;
+		case 'b':
+			baseFile = optarg;
+			break;
+		case 'o':
+			outFile = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r runs] [-m ms] [-b baseline.json] [-o out.json] [-t percent]\n", argv[0]);
+			return (2);
+		}
+	}
+	if (runs < 1)
+		runs = 1;
+	for (n = 0; n < (int) RX_MIX; n++)
+		checksum(rxMix[n]);
+	checksum(svRead);
+	checksum(svWrite);
+	if (baseFile && !readJson(baseFile, base, &baseCount, baseMachine)) {
+		fprintf(stderr, "cannot read %s\n", baseFile);
+		return (2);
+	}
+
+	machineName(machine);
+	printf("machine: %s\n", machine);
+	if (baseFile)
+		printf("baseline: %s%s\n", baseMachine, strcmp(baseMachine, machine) ? " (another machine)" : "");
+
+	printf("%-16s %10s %10s", "benchmark", "ns/op", "allocs/op");
+	if (baseFile)
+		printf(" %10s %8s", "baseline", "change");
+	printf("\n");
+	for (n = 0; n < (int) BENCHES; n++) {
+		measure(&benches[n], runs, minMs, &res[n]);
+		printf("%-16s %10.1f %10.3f", res[n].name, res[n].ns, res[n].allocs);
+		for (b = 0; b < baseCount && strcmp(base[b].name, res[n].name); b++)
+			;
+		if (b < baseCount) {
+			change = 100 * (res[n].ns - base[b].ns) / base[b].ns;
+			printf(" %10.1f %+7.1f%%", base[b].ns, change);
+			if (change > tolerance || res[n].allocs > base[b].allocs) {
+				printf("  WORSE");
+				worse = true;
+			}
+		} else if (baseFile)
+			printf(" %10s", "-");
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (outFile && !writeJson(outFile, res, BENCHES, machine)) {
+		fprintf(stderr, "cannot write %s\n", outFile);
+		return (2);
+	}
+	return (worse ? 1 : 0);
+}
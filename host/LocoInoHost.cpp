@@ -0,0 +1,250 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Runs the sketch on the Linux host backend, driven by a script read from
+ a file or stdin, one command per line (# starts a comment):
+
+   rx <hex bytes>   packet received from LocoNet, the checksum can be left out
+   in <n> <level>   level of I/O n (1-16), 0 = low (occupied), 1 = high
+   run <ms>         call loop() for ms of virtual time
+   boot             power cycle: the EEPROM and the input levels stay, the
+                    sketch starts over with setup()
+   fail <n>         the next n send attempts end in a collision
+
+ Packets sent and changes of the outputs are printed with the virtual
+ time in ms:
+
+   1234.500 tx B2 05 70 38
+   1234.600 collision B2 05 70 38
+   1250.000 out 0001
+   1300.000 boot
+
+ host/test holds scripts with their expected output, run by ctest.
+
+ Options:
+   -e file   EEPROM image, loaded at start (if it exists) and saved at exit
+   -t file   serial port output (binary trace, tools/locoino_trace.py)
+   -s us     virtual time taken by every loop(), default 100
+ *************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "Hal.h"
+
+uint32_t loopStep = 100;   //us of virtual time per loop()
+uint16_t lastOutputs;
+uint32_t failCount;        //Send attempts still to fail
+uint8_t *pristine;         //FW_STATE before setup(), for boot
+
+static void printTime() {
+	printf("%10.3f", host.time / 1000.0);
+}
+
+//Every packet goes out at the first attempt, unless fail asked for collisions
+static LN_STATUS printSend(lnMsg *msg, uint8_t prioDelay) {
+	uint8_t n, len;
+
+	(void) prioDelay;
+	len = getLnMsgSize(msg);
+	printTime();
+	printf(failCount ? " collision" : " tx");
+	for (n = 0; n < len; n++)
+		printf(" %02X", msg->data[n]);
+	printf("\n");
+	if (failCount) {
+		failCount--;
+		return (LN_COLLISION);
+	}
+	return (LN_DONE);
+}
+
+//Start the sketch from scratch on the EEPROM and inputs of the board
+static void boot() {
+	uint8_t eeprom[sizeof(host.eeprom)];
+	uint16_t pins;
+	uint64_t time;
+	FILE *serial;
+
+	memcpy(eeprom, host.eeprom, sizeof(eeprom));
+	pins = host.pins;
+	time = host.time;
+	serial = host.serial;
+	memcpy(__start_fw_state, pristine, __stop_fw_state - __start_fw_state);
+	hostInit();
+	memcpy(host.eeprom, eeprom, sizeof(eeprom));
+	host.pins = pins;
+	host.time = time;
+	host.serial = serial;
+	host.send = printSend;
+	setup();
+	lastOutputs = hostOutputs();
+}
+
+static void run(uint32_t ms) {
+	uint64_t end;
+
+	end = host.time + (uint64_t) ms * 1000;
+	while (host.time < end) {
+		hostAdvance(loopStep);
+		loop();
+		if (hostOutputs() != lastOutputs) {
+			lastOutputs = hostOutputs();
+			printTime();
+			printf(" out %04X\n", lastOutputs);
+		}
+	}
+}
+
+//One line of the script, false if it is not understood
+static boolean command(char *line) {
+	char *cmd, *arg, *end;
+	uint8_t data[16], len, sum, n;
+	unsigned long value, level;
+
+	cmd = strtok(line, " \t\r\n");
+	if (!cmd || cmd[0] == '#')
+		return (true);
+
+	if (!strcmp(cmd, "rx")) {
+		len = 0;
+		while ((arg = strtok(NULL, " \t\r\n")) && len < sizeof(data)) {
+			value = strtoul(arg, &end, 16);
+			if (*end || value > 0xff)
+				return (false);
+			data[len++] = value;
+		}
+		if (!len || arg)
+			return (false);
+		//Add the checksum when it is missing
+		if (len == getLnMsgSize((const lnMsg *) data) - 1) {
+			for (n = 0, sum = 0xff; n < len; n++)
+				sum ^= data[n];
+			data[len++] = sum;
+		}
+		if (len != getLnMsgSize((const lnMsg *) data))
+			return (false);
+		return (hostReceive(&host, data, len));
+	}
+
+	if (!strcmp(cmd, "in")) {
+		arg = strtok(NULL, " \t\r\n");
+		value = arg ? strtoul(arg, &end, 10) : 0;
+		arg = strtok(NULL, " \t\r\n");
+		level = arg ? strtoul(arg, NULL, 10) : 2;
+		if (value < 1 || value > 16 || level > 1)
+			return (false);
+		hostSetInputs(level ? host.pins | bit(value - 1) : host.pins & ~bit(value - 1));
+		return (true);
+	}
+
+	if (!strcmp(cmd, "boot")) {
+		printTime();
+		printf(" boot\n");
+		boot();
+		return (true);
+	}
+
+	if (!strcmp(cmd, "fail")) {
+		arg = strtok(NULL, " \t\r\n");
+		if (!arg)
+			return (false);
+		failCount = strtoul(arg, NULL, 10);
+		return (true);
+	}
+
+	if (!strcmp(cmd, "run")) {
+		arg = strtok(NULL, " \t\r\n");
+		if (!arg)
+			return (false);
+		run(strtoul(arg, NULL, 10));
+		return (true);
+	}
+
+	return (false);
+}
+
+int main(int argc, char **argv) {
+	const char *eeFile = NULL;
+	FILE *f, *script;
+	char line[256];
+	int opt, lineNo, errors = 0;
+
+	pristine = (uint8_t *) malloc(__stop_fw_state - __start_fw_state);
+	memcpy(pristine, __start_fw_state, __stop_fw_state - __start_fw_state);
+	hostInit();
+	while ((opt = getopt(argc, argv, "e:t:s:")) != -1) {
+		switch (opt) {
+		case 'e':
+			eeFile = optarg;
+			break;
+		case 't':
+			host.serial = fopen(optarg, "wb");
+			if (!host.serial) {
+				perror(optarg);
+				return (1);
+			}
+			break;
+		case 's':
+			loopStep = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-e eeprom.bin] [-t trace.bin] [-s step_us] [script]\n", argv[0]);
+			return (1);
+		}
+	}
+
+	script = stdin;
+	if (optind < argc) {
+		script = fopen(argv[optind], "r");
+		if (!script) {
+			perror(argv[optind]);
+			return (1);
+		}
+	}
+
+	if (eeFile && (f = fopen(eeFile, "rb"))) {
+		if (fread(host.eeprom, 1, sizeof(host.eeprom), f) != sizeof(host.eeprom))
+			fprintf(stderr, "%s: short EEPROM image\n", eeFile);
+		fclose(f);
+	}
+
+	host.send = printSend;
+	setup();
+	lastOutputs = hostOutputs();
+
+	lineNo = 0;
+	while (fgets(line, sizeof(line), script)) {
+		lineNo++;
+		if (!command(line)) {
+			fprintf(stderr, "line %d: not understood\n", lineNo);
+			errors++;
+		}
+	}
+
+	if (eeFile) {
+		f = fopen(eeFile, "wb");
+		if (!f || fwrite(host.eeprom, 1, sizeof(host.eeprom), f) != sizeof(host.eeprom)) {
+			perror(eeFile);
+			return (1);
+		}
+		fclose(f);
+	}
+	if (host.serial)
+		fclose(host.serial);
+	return (errors ? 1 : 0);
+}
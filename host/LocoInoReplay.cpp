@@ -0,0 +1,475 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Replay of a session recorded on the layout, on the host build of the
+ sketch. The capture is the serial trace of a module built with
+ TRACE_LEVEL 2, saved with tools/locoino_trace.py --save: every packet
+ received (TR_RX), sent (TR_TX) and every input edge (TR_EDGE).
+
+ The file is mapped in memory and read as it goes, so captures of hours
+ do not have to fit in RAM. Packets received are fed to the board and
+ input edges drive its pins at their recorded time, loop() runs in
+ between. The board answers through its own packets, they are not fed
+ back: the capture holds what the bus carried.
+
+ Latencies reported, in ms:
+  - edges, recorded: from the capture of an edge to the recorded TX of
+    its report, what the module did on the layout
+  - edges, replay: the same for the host build, to compare a change of
+    the code with the recording
+  - switch requests, replay: from feeding a request for our outputs to
+    the loop() that changes them
+ and the real time taken by loop().
+ Reports are matched to inputs through the SVs of the replay board, give
+ it the EEPROM of the module (-e) for the recorded figures to mean
+ anything. The 16 bit ms of the records are unwrapped, and set again from
+ every TR_TICK, so a gap of any length between two records keeps its time.
+ Latencies of LAT_MS or more only count in the last bucket of the
+ histogram, a percentile there prints as ">=LAT_MS".
+
+ Usage: locoino_replay [-e eeprom] [-x speed] [-s us] capture.bin
+   -e file   EEPROM image of the module, like locoino_host
+   -x speed  1 (default) in real time, 100 a hundred times faster, 0 as fast as possible
+   -s us     virtual time taken by every loop(), default 100
+ *************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Hal.h"
+#include "Trace.h"
+
+//Inside the sketch
+uint8_t readSV(uint8_t n);
+uint16_t switchPins(uint16_t Address);
+
+#define EDGE_FIFO 4          //Edges of an input waiting for their report
+#define LAT_MS 2000          //Latency histogram, 1 ms per bucket up to LAT_MS, the last one holds the rest
+#define START_US 100000      //Virtual time of the first record, after setup()
+#define SWREQ_PENDING 16
+
+//Records of the capture, one event at a time
+#define EV_RX 1
+#define EV_TX 2
+#define EV_EDGE 3
+
+typedef struct {
+	const uint8_t *p, *end;
+	uint64_t base;           //ms of the wraps of the 16 bit time so far, from the last TR_TICK on
+	uint16_t last;
+	boolean started;
+	uint32_t records, lost;
+} READER;
+
+typedef struct {
+	uint8_t type;
+	uint64_t ms;
+	uint8_t data[4];
+} RECORD;
+
+typedef struct {
+	uint8_t type;
+	uint64_t us;
+	uint16_t levels;
+	lnMsg msg;
+} EVENT;
+
+typedef struct {
+	uint64_t us;
+	uint8_t level;
+} EDGE;
+
+//Edges matched with their reports, and the latency
+typedef struct {
+	uint16_t levels;
+	EDGE edges[16][EDGE_FIFO];
+	uint8_t count[16];
+	uint32_t seen, reported, merged, overflow;
+	uint64_t latSum, latMax;
+	uint32_t lat[LAT_MS + 1];
+} MATCH;
+
+typedef struct {
+	uint32_t count;
+	uint64_t latSum, latMax;
+	uint32_t lat[LAT_MS + 1];
+} LATENCY;
+
+MATCH recorded, replayed;
+LATENCY swreq;
+uint64_t swreqTime[SWREQ_PENDING];
+uint8_t swreqCount;
+uint32_t swreqNoChange, rxDropped;
+uint32_t loopStep = 100;
+
+//Next valid record, false at the end of the capture
+static boolean nextRecord(READER *r, RECORD *rec) {
+	uint8_t n, check;
+	uint16_t time;
+	uint32_t tick;
+
+	while (r->end - r->p >= TRACE_SIZE) {
+		for (n = 0, check = 0; n < TRACE_SIZE; n++)
+			check ^= r->p[n];
+		if (check != 0xff || r->p[0] < TR_BOOT || r->p[0] > TR_TICK) {
+			r->p++;
+			continue;
+		}
+		time = r->p[1] | (r->p[2] << 8);
+		if (r->started && time < r->last)
+			r->base += 0x10000;
+		//Whole millis() of the module: wraps missed in a long quiet time are back
+		if (r->p[0] == TR_TICK) {
+			tick = r->p[3] | (r->p[4] << 8) | ((uint32_t) r->p[5] << 16) | ((uint32_t) r->p[6] << 24);
+			r->base = (uint64_t) tick - time;
+		}
+		r->started = true;
+		r->last = time;
+		rec->type = r->p[0];
+		rec->ms = r->base + time;
+		memcpy(rec->data, r->p + 3, 4);
+		r->p += TRACE_SIZE;
+		r->records++;
+		return (true);
+	}
+	return (false);
+}
+
+//Next packet or edge of the capture, false at the end
+static boolean nextEvent(READER *r, EVENT *e) {
+	RECORD rec;
+	READER ahead;
+	uint8_t len, got;
+	uint16_t time;
+
+	while (nextRecord(r, &rec)) {
+		switch (rec.type) {
+		case TR_LOST:
+			r->lost += rec.data[0] | (rec.data[1] << 8);
+			break;
+		case TR_EDGE:
+			//Captured a little before the record, in the same 16 bit ms
+			time = rec.data[2] | (rec.data[3] << 8);
+			e->type = EV_EDGE;
+			e->us = (rec.ms - (uint16_t) (r->last - time)) * 1000;
+			e->levels = rec.data[0] | (rec.data[1] << 8);
+			return (true);
+		case TR_RX:
+		case TR_TX:
+			e->type = rec.type == TR_RX ? EV_RX : EV_TX;
+			e->us = rec.ms * 1000;
+			memset(&e->msg, 0, sizeof(e->msg));
+			memcpy(e->msg.data, rec.data, 4);
+			len = getLnMsgSize(&e->msg);
+			if (len < 2 || len > sizeof(e->msg.data))
+				break;
+			//The rest of the packet, a record that does not follow is left for the next call
+			for (got = 4; got < len; got += 4) {
+				ahead = *r;
+				if (!nextRecord(&ahead, &rec) || rec.type != TR_MORE)
+					break;
+				*r = ahead;
+				memcpy(e->msg.data + got, rec.data, len - got < 4 ? len - got : 4);
+			}
+			if (got >= len)
+				return (true);
+			break;
+		}
+	}
+	return (false);
+}
+
+static void latency(LATENCY *l, uint64_t us) {
+	l->count++;
+	l->latSum += us;
+	if (us > l->latMax)
+		l->latMax = us;
+	l->lat[us / 1000 < LAT_MS ? us / 1000 : LAT_MS]++;
+}
+
+//Inputs, 1 bit each, from the pin config SVs
+static uint16_t inputs() {
+	uint8_t n;
+	uint16_t mask = 0;
+
+	for (n = 0; n < 16; n++) {
+		if (!bitRead(readSV(3 + 3 * n), 7))
+			bitSet(mask, n);
+	}
+	return (mask);
+}
+
+static void edgeSeen(MATCH *m, uint16_t levels, uint64_t us) {
+	uint16_t changed;
+	uint8_t n, i;
+
+	changed = (levels ^ m->levels) & inputs();
+	m->levels = levels;
+	for (n = 0; n < 16; n++) {
+		if (!bitRead(changed, n))
+			continue;
+		m->seen++;
+		if (m->count[n] == EDGE_FIFO) {
+			m->overflow++;
+			for (i = 1; i < EDGE_FIFO; i++)
+				m->edges[n][i - 1] = m->edges[n][i];
+			m->count[n]--;
+		}
+		m->edges[n][m->count[n]].us = us;
+		m->edges[n][m->count[n]].level = bitRead(levels, n);
+		m->count[n]++;
+	}
+}
+
+//OPC_INPUT_REP on the bus: the newest edge of its input to the same level, the
+//older ones were merged into it or filtered by the debounce
+static void reportSeen(MATCH *m, const lnMsg *msg, uint64_t us) {
+	uint8_t n, i, j, level;
+	uint64_t lat;
+
+	if (msg->data[0] != OPC_INPUT_REP)
+		return;
+	for (n = 0; n < 16; n++) {
+		if ((readSV(3 + 3 * n + 1) & 0x7f) == msg->ir.in1
+				&& (readSV(3 + 3 * n + 2) & 0x6f) == (msg->ir.in2 & 0x6f) && !bitRead(readSV(3 + 3 * n), 7))
+			break;
+	}
+	if (n == 16)
+		return;
+	level = msg->ir.in2 & OPC_INPUT_REP_HI ? 0 : 1;
+	for (i = m->count[n]; i > 0 && m->edges[n][i - 1].level != level; i--)
+		;
+	if (!i)
+		return;
+	i--;
+	m->merged += i;
+	m->reported++;
+	lat = us > m->edges[n][i].us ? us - m->edges[n][i].us : 0;
+	m->latSum += lat;
+	if (lat > m->latMax)
+		m->latMax = lat;
+	m->lat[lat / 1000 < LAT_MS ? lat / 1000 : LAT_MS]++;
+	for (j = 0, i++; i < m->count[n]; i++, j++)
+		m->edges[n][j] = m->edges[n][i];
+	m->count[n] = j;
+}
+
+//Packets of the replay board, sent at once
+static LN_STATUS replaySend(lnMsg *msg, uint8_t prioDelay) {
+	reportSeen(&replayed, msg, host.time);
+	return (LN_DONE);
+}
+
+//Latency (ms) at fraction f of the histogram, as text in buf: ">=LAT_MS" when it is in the
+//last bucket, which only gives a lower bound
+static const char *percentile(char *buf, const uint32_t *lat, uint32_t count, double f) {
+	uint32_t n, seen;
+
+	for (n = 0, seen = 0; n < LAT_MS; n++) {
+		seen += lat[n];
+		if (seen && seen >= count * f)
+			break;
+	}
+	snprintf(buf, 12, n < LAT_MS ? "%u" : ">=%u", n);
+	return (buf);
+}
+
+static void printLatency(const char *name, const uint32_t *lat, uint32_t count, uint64_t sum, uint64_t max) {
+	char p50[12], p95[12], p99[12];
+
+	printf("%-24s avg %.1f p50 %s p95 %s p99 %s max %.1f\n", name, count ? sum / 1000.0 / count : 0.0,
+			percentile(p50, lat, count, 0.50), percentile(p95, lat, count, 0.95),
+			percentile(p99, lat, count, 0.99), max / 1000.0);
+}
+
+static void printMatch(const char *name, MATCH *m) {
+	uint32_t pending = 0;
+	uint8_t n;
+
+	for (n = 0; n < 16; n++)
+		pending += m->count[n];
+	printf("%-24s %u edges, %u reported, %u merged, %u not reported\n", name, m->seen, m->reported,
+			m->merged + m->overflow, pending);
+	printLatency("", m->lat, m->reported, m->latSum, m->latMax);
+}
+
+static double realTime() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+//One loop(), timed, and the switch requests it handled
+static void runLoop(uint64_t *loopNs, uint64_t *loopMax, uint32_t *loops) {
+	uint16_t outputs;
+	double start;
+	uint64_t ns;
+
+	outputs = hostOutputs();
+	start = realTime();
+	loop();
+	ns = (uint64_t) ((realTime() - start) * 1e9);
+	*loopNs += ns;
+	if (ns > *loopMax)
+		*loopMax = ns;
+	(*loops)++;
+
+	//Requests are handled in the loop() that reads them
+	if (swreqCount && host.rxTail == host.rxHead) {
+		if (hostOutputs() != outputs) {
+			while (swreqCount)
+				latency(&swreq, host.time - swreqTime[--swreqCount]);
+		} else {
+			swreqNoChange += swreqCount;
+			swreqCount = 0;
+		}
+	}
+	hostAdvance(loopStep);
+}
+
+int main(int argc, char **argv) {
+	const char *eeFile = NULL;
+	double speed = 1, start, ahead;
+	int opt, fd;
+	struct stat st;
+	uint8_t *map;
+	FILE *f;
+	READER r;
+	EVENT e;
+	uint64_t first = 0, at, last = 0, loopNs = 0, loopMax = 0;
+	uint32_t loops = 0, packets = 0, edges = 0;
+	boolean started = false;
+
+	while ((opt = getopt(argc, argv, "e:x:s:")) != -1) {
+		switch (opt) {
+		case 'e':
+			eeFile = optarg;
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 's':
+			loopStep = atoi(optarg);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-e eeprom] [-x speed] [-s us] capture.bin\n", argv[0]);
+		return (2);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return (2);
+	}
+	if (st.st_size < TRACE_SIZE) {
+		fprintf(stderr, "%s: no records\n", argv[optind]);
+		return (2);
+	}
+	map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return (2);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	memset(&r, 0, sizeof(r));
+	r.p = map;
+	r.end = map + st.st_size;
+
+	hostInit();
+	if (eeFile) {
+		f = fopen(eeFile, "rb");
+		if (!f) {
+			perror(eeFile);
+			return (2);
+		}
+		if (fread(host.eeprom, 1, sizeof(host.eeprom), f) != sizeof(host.eeprom))
+			fprintf(stderr, "%s: short EEPROM image, the rest is blank\n", eeFile);
+		fclose(f);
+	}
+	host.send = replaySend;
+	setup();
+	recorded.levels = replayed.levels = halReadInputs();
+
+	start = realTime();
+	while (nextEvent(&r, &e)) {
+		//Virtual time of the event, never back in time
+		if (!started) {
+			first = e.us;
+			started = true;
+		}
+		at = START_US + (e.us > first ? e.us - first : 0);
+		if (at < last)
+			at = last;
+		last = at;
+
+		while (host.time < at) {
+			runLoop(&loopNs, &loopMax, &loops);
+			if (speed > 0) {
+				ahead = host.time / 1e6 / speed - (realTime() - start);
+				if (ahead > 0.002)
+					usleep((useconds_t) (ahead * 1e6));
+			}
+		}
+
+		switch (e.type) {
+		case EV_RX:
+			packets++;
+			if (e.msg.data[0] == OPC_SW_REQ
+					&& switchPins((((e.msg.data[2] & 0x0f) << 7) | e.msg.data[1]) + 1)
+					&& swreqCount < SWREQ_PENDING)
+				swreqTime[swreqCount++] = host.time;
+			if (!hostReceive(&host, e.msg.data, getLnMsgSize(&e.msg)))
+				rxDropped++;
+			break;
+		case EV_TX:
+			reportSeen(&recorded, &e.msg, at);
+			break;
+		case EV_EDGE:
+			edges++;
+			edgeSeen(&recorded, e.levels, at);
+			edgeSeen(&replayed, e.levels, host.time);
+			hostSetInputs(e.levels);
+			break;
+		}
+	}
+	//Time for the last reports
+	at = host.time + 1000000;
+	while (host.time < at)
+		runLoop(&loopNs, &loopMax, &loops);
+
+	printf("capture: %u records, %u lost, %u packets received, %u edges, %.1f s\n", r.records, r.lost, packets,
+			edges, (last - START_US) / 1e6);
+	printMatch("edges, recorded", &recorded);
+	printMatch("edges, replay", &replayed);
+	printf("%-24s %u changed the outputs, %u did not\n", "switch requests, replay", swreq.count, swreqNoChange);
+	printLatency("", swreq.lat, swreq.count, swreq.latSum, swreq.latMax);
+	printf("loop(): %u calls, real time avg %.0f ns max %llu ns, %u packets dropped (RX ring full)\n", loops,
+			loops ? (double) loopNs / loops : 0.0, (unsigned long long) loopMax, rxDropped);
+	munmap(map, st.st_size);
+	close(fd);
+	return (0);
+}
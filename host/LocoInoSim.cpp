@@ -0,0 +1,578 @@
+/**************************************************************************
+ LocoIno - Configurable Arduino Loconet Module
+ Copyright (C) 2014 Daniel Guisado Serra
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ------------------------------------------------------------------------
+ DESCRIPTION:
+ Discrete event simulation of one LocoNet segment with many LocoIno
+ boards, to see how much sensor traffic it carries before reports are
+ delayed or lost.
+
+ Every board runs the sketch on the host backend. The globals of the
+ sketch (FW_STATE) are swapped in before a board runs and out after it.
+ Events are processed in time order, on a virtual clock:
+  - end of a packet on the bus
+  - input edges, -r per second and board (Poisson), on a random input.
+    No edge is made on an input within EDGE_HOLD_MS of its previous one,
+    real detectors do not chatter past the debounce
+  - loop() of a board, every -l us and -p us at most after something
+    happened to it (packet received, input edge, bus free again)
+
+ Bus: 16.66 kbit/s, 60 us per bit and 10 bits per byte. A board starts
+ sending once the bus was idle for its priority delay, like
+ sendLocoNetPacketTry() (carrier detect backoff, LN_BACKOFF_MIN to
+ LN_BACKOFF_MAX bit times). Boards starting within -w us of the first one
+ do not hear it and collide: all of them stop after a byte and a 15 bit
+ break and get LN_COLLISION. A packet that goes through is received by
+ every board, the sender too.
+
+ Board b has 16 inputs, input n reports sensor 16 * b + n. Latency is
+ from the edge on the pin to the end of its report on the bus. An edge is:
+  - reported, a report with its level went through after it
+  - merged, a later edge of the input was reported or is waiting
+  - lost, the last edge of an input not reported by the end (edges of the
+    last second are not counted)
+ The same options and seed give the same run.
+
+ Usage: locoino_sim [-n boards] [-t seconds] [-r edges] [-s seed]
+                    [-l loop_us] [-p poll_us] [-w window_us] [-x speed] [-v]
+   -x speed   run at speed times real time, 0 (default) as fast as possible
+   -v         a line per board
+ *************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "Hal.h"
+
+#define BIT_US 60
+#define BYTE_US (10 * BIT_US)
+#define BREAK_BITS 15
+#define MAX_BOARDS 256
+#define EDGE_FIFO 8          //Edges of an input waiting for their report
+#define EDGE_HOLD_MS 100
+#define LAT_MS 2000          //Latency histogram, 1 ms per bucket up to LAT_MS, the last one holds the rest
+#define WARMUP_US 1000000    //No edges in the first second, boards boot and commit their SVs
+#define SV_VERSION 101       //VERSION of LocoIno.cpp
+
+//Events, in this order when they have the same time
+#define EV_BUS 0
+#define EV_EDGE 1
+#define EV_LOOP 2
+
+typedef struct {
+	uint64_t time;
+	uint8_t type;
+	uint16_t board;
+} EVENT;
+
+typedef struct {
+	uint64_t time;
+	uint8_t level;
+} EDGE;
+
+typedef struct {
+	uint8_t *state;          //FW_STATE section of the board while it is swapped out
+	uint64_t next;           //Time of the next loop()
+	uint64_t nextEdge;
+	uint16_t level;          //Level of the inputs, 1 = free
+	uint64_t lastEdge[16];
+	EDGE edges[16][EDGE_FIFO];
+	uint8_t edgeCount[16];
+
+	//Send attempt
+	boolean sending;         //Started, the status is not collected yet
+	boolean done;            //Over, txStatus is the result
+	LN_STATUS txStatus;
+	lnMsg txMsg;
+	boolean waiting;         //Bus busy, try again once it is free
+	uint8_t prio;
+
+	uint32_t edgesMade, reported, merged, lost, collisions, packets, rxLost;
+	uint64_t latSum;
+	uint32_t latMax;
+	uint32_t lat[LAT_MS + 1];
+} BOARD;
+
+typedef struct {
+	uint64_t idleSince;      //End of the last packet or break
+	uint64_t end;            //End of what is on the bus now
+	uint64_t firstStart;
+	uint16_t senders[MAX_BOARDS];
+	uint16_t count;          //Boards sending now
+	boolean collided;
+	uint64_t busy;           //Time with something on the bus
+	uint32_t packets, collisions;
+} BUS;
+
+BOARD *boards;
+uint16_t boardCount = 60;
+int cur = -1;                //Board swapped in
+size_t stateSize;
+uint8_t *pristine;           //FW_STATE before any board ran
+BUS bus;
+uint64_t now;
+
+EVENT *heap;
+size_t heapLen, heapSize;
+
+uint64_t seed = 1;
+uint32_t loopUs = 1000, pollUs = 100, windowUs = 10;
+double edgeRate = 2;
+
+//xorshift64, the simulation's own generator
+static uint64_t rnd() {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return (seed);
+}
+
+static uint32_t jitter() {
+	return (pollUs ? rnd() % pollUs : 0);
+}
+
+static boolean before(const EVENT *a, const EVENT *b) {
+	if (a->time != b->time)
+		return (a->time < b->time);
+	if (a->type != b->type)
+		return (a->type < b->type);
+	return (a->board < b->board);
+}
+
+static void push(uint64_t time, uint8_t type, uint16_t board) {
+	size_t n, parent;
+	EVENT e;
+
+	if (heapLen == heapSize) {
+		heapSize = heapSize ? heapSize * 2 : 1024;
+		heap = (EVENT *) realloc(heap, heapSize * sizeof(EVENT));
+	}
+	e.time = time;
+	e.type = type;
+	e.board = board;
+	for (n = heapLen++; n > 0; n = parent) {
+		parent = (n - 1) / 2;
+		if (!before(&e, &heap[parent]))
+			break;
+		heap[n] = heap[parent];
+	}
+	heap[n] = e;
+}
+
+static EVENT pop() {
+	EVENT top, last;
+	size_t n, child;
+
+	top = heap[0];
+	last = heap[--heapLen];
+	for (n = 0; (child = 2 * n + 1) < heapLen; n = child) {
+		if (child + 1 < heapLen && before(&heap[child + 1], &heap[child]))
+			child++;
+		if (!before(&heap[child], &last))
+			break;
+		heap[n] = heap[child];
+	}
+	heap[n] = last;
+	return (top);
+}
+
+//Run loop() of board b at time at the latest
+static void wake(uint16_t b, uint64_t time) {
+	if (time < boards[b].next) {
+		boards[b].next = time;
+		push(time, EV_LOOP, b);
+	}
+}
+
+static void swapTo(uint16_t b) {
+	if (cur == b)
+		return;
+	if (cur >= 0)
+		memcpy(boards[cur].state, __start_fw_state, stateSize);
+	memcpy(__start_fw_state, boards[b].state, stateSize);
+	cur = b;
+}
+
+//Global of the sketch or the backend, as board b has it
+static void *boardVar(uint16_t b, volatile void *var) {
+	if (cur == b)
+		return ((void *) var);
+	return (boards[b].state + ((uint8_t *) var - __start_fw_state));
+}
+
+//Bring the clock of the board swapped in to now
+static void advance() {
+	if (now > host.time)
+		hostAdvance(now - host.time);
+}
+
+//halLnSend() of every board, see the description at the top
+static LN_STATUS busSend(lnMsg *msg, uint8_t prioDelay) {
+	BOARD *bd = &boards[cur];
+	uint32_t idle;
+
+	if (bd->sending) {
+		if (!bd->done)
+			return (LN_TX_PENDING);
+		bd->sending = false;
+		return (bd->txStatus);
+	}
+
+	if (prioDelay < LN_BACKOFF_MIN)
+		prioDelay = LN_BACKOFF_MIN;
+	else if (prioDelay > LN_BACKOFF_MAX)
+		prioDelay = LN_BACKOFF_MAX;
+
+	if (bus.count) {
+		if (now - bus.firstStart >= windowUs) {
+			bd->waiting = true;
+			bd->prio = prioDelay;
+			return (LN_NETWORK_BUSY);
+		}
+		//Too close to the first sender to hear it: everybody stops after a byte and a break
+		bus.collided = true;
+		bus.end = now + BYTE_US + BREAK_BITS * BIT_US;
+		push(bus.end, EV_BUS, 0);
+	} else {
+		idle = (now - bus.idleSince) / BIT_US;
+		if (idle < prioDelay) {
+			wake(cur, bus.idleSince + prioDelay * BIT_US + jitter());
+			return (idle < LN_BACKOFF_MIN ? LN_CD_BACKOFF : LN_PRIO_BACKOFF);
+		}
+		bus.firstStart = now;
+		bus.collided = false;
+		bus.end = now + getLnMsgSize(msg) * BYTE_US;
+		push(bus.end, EV_BUS, 0);
+	}
+
+	bus.senders[bus.count++] = cur;
+	bd->sending = true;
+	bd->done = false;
+	bd->waiting = false;
+	memcpy(&bd->txMsg, msg, sizeof(lnMsg));
+	return (LN_TX_PENDING);
+}
+
+//A report went through: match it with the edges of its input
+static void reportSeen(const lnMsg *msg) {
+	uint16_t addr;
+	uint8_t level, pin, n, i;
+	BOARD *bd;
+	uint32_t latency;
+
+	addr = (msg->ir.in1 << 1) | ((msg->ir.in2 >> 5) & 1) | ((msg->ir.in2 & 0x0f) << 8);
+	if (addr / 16 >= boardCount)
+		return;
+	bd = &boards[addr / 16];
+	pin = addr % 16;
+	level = msg->ir.in2 & OPC_INPUT_REP_HI ? 0 : 1;
+
+	//The newest edge to that level, the board reports the latest level and the older ones merged into it
+	for (n = bd->edgeCount[pin]; n > 0 && bd->edges[pin][n - 1].level != level; n--)
+		;
+	if (!n)
+		return;
+	n--;
+	bd->merged += n;
+	bd->reported++;
+	latency = (now - bd->edges[pin][n].time) / 1000;
+	bd->latSum += latency;
+	if (latency > bd->latMax)
+		bd->latMax = latency;
+	bd->lat[latency < LAT_MS ? latency : LAT_MS]++;
+	n++;
+	for (i = 0; n < bd->edgeCount[pin]; i++, n++)
+		bd->edges[pin][i] = bd->edges[pin][n];
+	bd->edgeCount[pin] = i;
+}
+
+static void busEnd() {
+	uint16_t n, b;
+	BOARD *sender;
+	uint8_t len;
+
+	if (!bus.count || now != bus.end)
+		return;
+
+	bus.busy += now - bus.firstStart;
+	if (bus.collided) {
+		bus.collisions++;
+		for (n = 0; n < bus.count; n++) {
+			boards[bus.senders[n]].txStatus = LN_COLLISION;
+			boards[bus.senders[n]].collisions++;
+		}
+	} else {
+		sender = &boards[bus.senders[0]];
+		sender->txStatus = LN_DONE;
+		sender->packets++;
+		bus.packets++;
+		len = getLnMsgSize(&sender->txMsg);
+		for (b = 0; b < boardCount; b++) {
+			if (!hostReceive((HOST *) boardVar(b, &host), sender->txMsg.data, len))
+				boards[b].rxLost++;
+			wake(b, now + jitter());
+		}
+		if (sender->txMsg.data[0] == OPC_INPUT_REP)
+			reportSeen(&sender->txMsg);
+	}
+	for (n = 0; n < bus.count; n++) {
+		boards[bus.senders[n]].done = true;
+		wake(bus.senders[n], now);
+	}
+	bus.count = 0;
+	bus.idleSince = now;
+
+	//Boards that found the bus busy count their priority delay from now
+	for (b = 0; b < boardCount; b++) {
+		if (boards[b].waiting) {
+			boards[b].waiting = false;
+			wake(b, now + boards[b].prio * BIT_US + jitter());
+		}
+	}
+}
+
+static void edge(uint16_t b) {
+	BOARD *bd = &boards[b];
+	uint8_t pin, n;
+
+	pin = rnd() % 16;
+	if (now - bd->lastEdge[pin] >= EDGE_HOLD_MS * 1000ULL) {
+		bd->lastEdge[pin] = now;
+		bd->level ^= bit(pin);
+		bd->edgesMade++;
+		//The oldest edge can only be merged into a later report now
+		if (bd->edgeCount[pin] == EDGE_FIFO) {
+			bd->merged++;
+			for (n = 1; n < EDGE_FIFO; n++)
+				bd->edges[pin][n - 1] = bd->edges[pin][n];
+			bd->edgeCount[pin]--;
+		}
+		bd->edges[pin][bd->edgeCount[pin]].time = now;
+		bd->edges[pin][bd->edgeCount[pin]].level = bitRead(bd->level, pin);
+		bd->edgeCount[pin]++;
+
+		swapTo(b);
+		advance();
+		hostSetInputs(bd->level);
+		wake(b, now + jitter());
+	}
+
+	//Exponential time to the next one
+	bd->nextEdge = now + (uint64_t) (-log((rnd() >> 11) * (1.0 / 9007199254740992.0) + 1e-18) / edgeRate * 1e6);
+	push(bd->nextEdge, EV_EDGE, b);
+}
+
+static void boot(uint16_t b) {
+	uint8_t n;
+	uint8_t *sv;
+
+	swapTo(b);
+	hostInit();
+	host.send = busSend;
+
+	//SV table of the old layout at 0, imported by loadConfig()
+	sv = host.eeprom;
+	memset(sv, 0, 99);
+	sv[0] = SV_VERSION;
+	sv[1] = 1 + b % 126;
+	sv[2] = 1 + b / 126;
+	for (n = 0; n < 16; n++) {
+		//cnfg 0: input. value1/value2: in1/in2 of its report
+		sv[3 + 3 * n + 1] = ((16 * b + n) >> 1) & 0x7f;
+		sv[3 + 3 * n + 2] = (((16 * b + n) >> 8) & 0x0f) | (((16 * b + n) & 1) << 5);
+		sv[67 + n] = 0xff;
+	}
+
+	host.time = now;
+	setup();
+	boards[b].level = host.pins;
+}
+
+//Latency (ms) at fraction f of the reported edges, as text in buf: ">=LAT_MS" when it is
+//in the last bucket of the histogram, which only gives a lower bound
+static const char *percentile(char *buf, const uint32_t *lat, uint32_t count, double f) {
+	uint32_t n, seen;
+
+	for (n = 0, seen = 0; n < LAT_MS; n++) {
+		seen += lat[n];
+		if (seen && seen >= count * f)
+			break;
+	}
+	snprintf(buf, 12, n < LAT_MS ? "%u" : ">=%u", n);
+	return (buf);
+}
+
+static void printStats(const char *name, BOARD *bd) {
+	char p50[12], p95[12], p99[12];
+
+	printf("%s edges %u reported %u merged %u lost %u collisions %u rx lost %u,"
+			" latency ms avg %.1f p50 %s p95 %s p99 %s max %u\n",
+			name, bd->edgesMade, bd->reported, bd->merged, bd->lost, bd->collisions, bd->rxLost,
+			bd->reported ? (double) bd->latSum / bd->reported : 0.0,
+			percentile(p50, bd->lat, bd->reported, 0.50), percentile(p95, bd->lat, bd->reported, 0.95),
+			percentile(p99, bd->lat, bd->reported, 0.99), bd->latMax);
+}
+
+static double realTime() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+int main(int argc, char **argv) {
+	uint64_t end;
+	double seconds = 60, speed = 0, start, elapsed;
+	boolean verbose = false;
+	int opt;
+	uint16_t b;
+	uint8_t pin, n;
+	uint32_t i;
+	EVENT e;
+	BOARD *total;
+	char name[16];
+
+	while ((opt = getopt(argc, argv, "n:t:r:s:l:p:w:x:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			boardCount = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'r':
+			edgeRate = atof(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			loopUs = atoi(optarg);
+			break;
+		case 'p':
+			pollUs = atoi(optarg);
+			break;
+		case 'w':
+			windowUs = atoi(optarg);
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n boards] [-t seconds] [-r edges] [-s seed] [-l loop_us] [-p poll_us]"
+					" [-w window_us] [-x speed] [-v]\n", argv[0]);
+			return (1);
+		}
+	}
+	if (boardCount < 1 || boardCount > MAX_BOARDS || edgeRate <= 0 || loopUs < 1) {
+		fprintf(stderr, "1 to %d boards, a rate and a loop time above 0\n", MAX_BOARDS);
+		return (1);
+	}
+	if (!seed)
+		seed = 1;
+	printf("boards %u, %.0f s, %.2f edges/s per board, seed %llu\n", boardCount, seconds, edgeRate,
+			(unsigned long long) seed);
+
+	stateSize = __stop_fw_state - __start_fw_state;
+	pristine = (uint8_t *) malloc(stateSize);
+	memcpy(pristine, __start_fw_state, stateSize);
+	boards = (BOARD *) calloc(boardCount, sizeof(BOARD));
+	total = (BOARD *) calloc(1, sizeof(BOARD));
+
+	//All boards power up within a loop time
+	for (b = 0; b < boardCount; b++) {
+		boards[b].state = (uint8_t *) malloc(stateSize);
+		memcpy(boards[b].state, pristine, stateSize);
+		boards[b].next = UINT64_MAX;
+		now = rnd() % loopUs;
+		boot(b);
+		wake(b, host.time);
+		boards[b].nextEdge = WARMUP_US + rnd() % 1000000;
+		push(boards[b].nextEdge, EV_EDGE, b);
+	}
+
+	end = (uint64_t) (seconds * 1e6);
+	start = realTime();
+	while (heapLen && heap[0].time <= end) {
+		e = pop();
+		now = e.time;
+		switch (e.type) {
+		case EV_BUS:
+			busEnd();
+			break;
+		case EV_EDGE:
+			edge(e.board);
+			break;
+		case EV_LOOP:
+			if (e.time != boards[e.board].next)
+				break;
+			boards[e.board].next = UINT64_MAX;
+			swapTo(e.board);
+			advance();
+			loop();
+			wake(e.board, now + loopUs);
+			break;
+		}
+
+		//Time warp: wait for the real time to catch up
+		if (speed > 0) {
+			elapsed = realTime() - start;
+			if (now / 1e6 / speed > elapsed + 0.001)
+				usleep((useconds_t) ((now / 1e6 / speed - elapsed) * 1e6));
+		}
+	}
+	elapsed = realTime() - start;
+	now = end;
+
+	printf("bus: %u packets, %u collisions, load %.1f %%\n", bus.packets, bus.collisions,
+			100.0 * bus.busy / end);
+	for (b = 0; b < boardCount; b++) {
+		BOARD *bd = &boards[b];
+
+		//Edges still waiting for a report: the older ones of an input go in the report of its
+		//last one, which is lost unless it is from the last second and may still make it
+		for (pin = 0; pin < 16; pin++) {
+			n = bd->edgeCount[pin];
+			if (!n)
+				continue;
+			bd->merged += n - 1;
+			if (bd->edges[pin][n - 1].time + 1000000 < end)
+				bd->lost++;
+		}
+		total->edgesMade += bd->edgesMade;
+		total->reported += bd->reported;
+		total->merged += bd->merged;
+		total->lost += bd->lost;
+		total->latSum += bd->latSum;
+		if (bd->latMax > total->latMax)
+			total->latMax = bd->latMax;
+		total->collisions += bd->collisions;
+		total->rxLost += bd->rxLost;
+		for (i = 0; i <= LAT_MS; i++)
+			total->lat[i] += bd->lat[i];
+		if (verbose) {
+			snprintf(name, sizeof(name), "board %3u", b);
+			printStats(name, bd);
+		}
+	}
+	printStats("all", total);
+	printf("%.1f s simulated in %.2f s (%.0fx)\n", seconds, elapsed, seconds / (elapsed > 0 ? elapsed : 1e-9));
+	return (0);
+}
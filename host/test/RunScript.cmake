@@ -0,0 +1,14 @@
+# Run a locoino_host script and compare its output with the expected one.
+# cmake -DPROGRAM=locoino_host -DSCRIPT=name.txt -DEXPECTED=name.out -DACTUAL=out -P RunScript.cmake
+execute_process(COMMAND ${PROGRAM} ${SCRIPT}
+	OUTPUT_VARIABLE output
+	ERROR_VARIABLE errors
+	RESULT_VARIABLE result)
+if(NOT result EQUAL 0 OR NOT errors STREQUAL "")
+	message(FATAL_ERROR "${SCRIPT} failed (${result}):\n${errors}")
+endif()
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+	file(WRITE ${ACTUAL} "${output}")
+	message(FATAL_ERROR "${SCRIPT}: output differs from ${EXPECTED}, see ${ACTUAL}")
+endif()
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Build the sketch for an Arduino Uno (ATmega328P) with arduino-cli. It needs
+# the AVR core and the MRRwA LocoNet library:
+#   arduino-cli core install arduino:avr
+#   arduino-cli lib install LocoNet
+# The sources are copied to a sketch folder in build/avr, the .hex and .elf
+# go to build/avr as well. Extra arguments are passed to arduino-cli compile.
+set -e
+cd "$(dirname "$0")/.."
+rm -rf build/avr/LocoIno
+mkdir -p build/avr/LocoIno
+cp GCA185-LocoIO/*.cpp GCA185-LocoIO/*.h build/avr/LocoIno/
+: > build/avr/LocoIno/LocoIno.ino
+arduino-cli compile -b arduino:avr:uno --warnings all --output-dir build/avr "$@" build/avr/LocoIno
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+"""Decode the binary trace sent by LocoIno on its serial port.
+
+The module sends records of 8 bytes (see GCA185-LocoIO/Trace.h):
+type, time in ms (low byte first), 4 data bytes and a check byte that
+makes the xor of the whole record 0xFF. Bytes that do not form a valid
+record are skipped, so decoding can start in the middle of the stream.
+The 16 bit time is unwrapped, and set again from the whole millis() of
+the TR_TICK records, so quiet periods of any length keep their time.
+
+Usage:
+    locoino_trace.py /dev/ttyUSB0          read a serial port (needs pyserial)
+    locoino_trace.py capture.bin           decode a file
+    locoino_trace.py -                     decode stdin
+
+With --save the bytes read are written to a file as they come. A capture
+of a module with TRACE_LEVEL 2 (packets and input edges) can be replayed
+on the host build with locoino_replay (host/LocoInoReplay.cpp).
+"""
+
+import argparse
+import sys
+
+RECORD_SIZE = 8
+
+TR_BOOT = 1
+TR_LOST = 2
+TR_INPUT = 3
+TR_SWREQ = 4
+TR_SVWRITE = 5
+TR_RX = 6
+TR_TX = 7
+TR_MORE = 8
+TR_SENSOR = 9
+TR_SWREP = 10
+TR_SWSTATE = 11
+TR_EDGE = 12
+TR_TICK = 13
+
+TYPES = range(TR_BOOT, TR_TICK + 1)
+
+
+def records(read):
+    """Yield (type, time, data) for every valid record in the bytes given by read()."""
+    buf = bytearray()
+    while True:
+        chunk = read()
+        if not chunk:
+            return
+        buf += chunk
+        while len(buf) >= RECORD_SIZE:
+            rec = buf[:RECORD_SIZE]
+            check = 0
+            for b in rec:
+                check ^= b
+            if rec[0] in TYPES and check == 0xFF:
+                yield rec[0], rec[1] | rec[2] << 8, bytes(rec[3:7])
+                del buf[:RECORD_SIZE]
+            else:
+                del buf[0]
+
+
+def packet_size(data):
+    """LocoNet message length from its first bytes."""
+    opcode = data[0]
+    if opcode & 0x60 == 0x60:
+        return data[1] if len(data) > 1 else 0
+    return ((opcode >> 5) & 0x03) * 2 + 2
+
+
+def address(data):
+    return data[0] | data[1] << 8
+
+
+def describe(kind, data):
+    if kind == TR_BOOT:
+        return "BOOT version %d address %d/%d" % (data[0], data[1], data[2])
+    if kind == TR_LOST:
+        return "LOST %d records" % address(data)
+    if kind == TR_INPUT:
+        return "INPUT %d %s (in1 %02X in2 %02X)" % (
+            data[0] + 1, "occupied" if data[1] else "free", data[2], data[3])
+    if kind == TR_SWREQ:
+        return "SWITCH REQUEST %d %s %s" % (
+            address(data), "closed" if data[3] else "thrown", "on" if data[2] else "off")
+    if kind == TR_SVWRITE:
+        return "SV %d <= %d (0x%02X)" % (data[0], data[1], data[1])
+    if kind == TR_SENSOR:
+        return "sensor %d %s" % (address(data), "active" if data[2] else "inactive")
+    if kind == TR_SWREP:
+        return "switch report %d %s %s" % (
+            address(data), "closed" if data[3] else "thrown", "on" if data[2] else "off")
+    if kind == TR_SWSTATE:
+        return "switch state %d %s %s" % (
+            address(data), "closed" if data[3] else "thrown", "on" if data[2] else "off")
+    if kind == TR_EDGE:
+        return "edge %04X captured at %d" % (address(data), data[2] | data[3] << 8)
+    return "type %d %s" % (kind, data.hex())
+
+
+def decode(read, out):
+    base = None
+    last = None
+    packet = None   # [kind, time, bytes, size] of a packet being joined
+
+    def flush_packet():
+        if packet:
+            kind, ms, data, size = packet
+            out.write("%10.3f %s %s\n" % (ms / 1000.0, "RX" if kind == TR_RX else "TX",
+                                         " ".join("%02X" % b for b in data[:size])))
+
+    for kind, time, data in records(read):
+        # Unwrap the 16 bit time
+        if last is None:
+            base = 0
+        elif time < last:
+            base += 0x10000
+        last = time
+        if kind == TR_TICK:
+            base = int.from_bytes(data, "little") - time
+            continue
+        ms = base + time
+
+        if kind == TR_MORE and packet:
+            packet[2] += data
+            if len(packet[2]) >= packet[3]:
+                flush_packet()
+                packet = None
+            continue
+        flush_packet()
+        packet = None
+
+        if kind in (TR_RX, TR_TX):
+            size = packet_size(data)
+            packet = [kind, ms, bytearray(data), size]
+            if size <= 4:
+                flush_packet()
+                packet = None
+            continue
+        out.write("%10.3f %s\n" % (ms / 1000.0, describe(kind, data)))
+        out.flush()
+    flush_packet()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="serial port, file or - for stdin")
+    parser.add_argument("--baud", type=int, default=57600, help="serial port speed")
+    parser.add_argument("--save", metavar="FILE", help="write the raw bytes read to FILE")
+    args = parser.parse_args()
+
+    save = open(args.save, "wb") if args.save else None
+
+    def saving(read):
+        if not save:
+            return read
+
+        def read_and_save():
+            chunk = read()
+            save.write(chunk)
+            save.flush()
+            return chunk
+        return read_and_save
+
+    try:
+        if args.source == "-":
+            decode(saving(lambda: sys.stdin.buffer.read1(64)), sys.stdout)
+        elif args.source.startswith("/dev/") or args.source.upper().startswith("COM"):
+            import serial
+            with serial.Serial(args.source, args.baud) as port:
+                decode(saving(lambda: port.read(port.in_waiting or 1)), sys.stdout)
+        else:
+            with open(args.source, "rb") as f:
+                decode(saving(lambda: f.read(4096)), sys.stdout)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if save:
+            save.close()
+
+
+if __name__ == "__main__":
+    main()